@@ -24,10 +24,13 @@
 #include "npk_ver.h"
 #include "platf.h"
 
+#include "cmd_parser.h"
 #include "eep_funcs.h"
 #include "iso_cmds.h"
 #include "npk_errcodes.h"
 #include "crc.h"
+#include "lz.h"
+#include "romcrc.h"
 
 #define MAX_INTERBYTE	10	//ms between bytes that causes a disconnect
 
@@ -88,6 +91,88 @@ static u32 reconst_24(const u8 *data) {
 	return tmp;
 }
 
+/******* RX ring buffer
+ * Filled by the SCI RXI / ERI interrupts, drained by cmd_loop(). This lets the host
+ * send the next request while we're still busy replying, erasing or writing.
+ * Single producer (ISR) + single consumer, so no locking is needed.
+ */
+#define SCI_RXBUF_SIZE	256	//must be a power of 2; holds a complete max-length iso14230 frame
+#define SCI_RXBUF_MASK	(SCI_RXBUF_SIZE - 1)
+#define SCI_RXERR_OVF	0x01	//ring buffer overflow. ORER | FER | PER are only reported per byte, in sci_rxbad[]
+
+static volatile u8 sci_rxbuf[SCI_RXBUF_SIZE];
+static volatile u8 sci_rxbad[SCI_RXBUF_SIZE / 8];	//bit set : that byte was received with ORER | FER | PER
+static volatile unsigned sci_rxhead;	//next write pos, only modified by the ISRs
+static volatile unsigned sci_rxtail;	//next read pos, only modified by the main loop
+static volatile u8 sci_rxerr;	//set by sci_rxstore(), cleared by sci_rxflush()
+
+/** add a byte to the ring buffer. Only called from the SCI ISRs */
+static void sci_rxstore(u8 rxbyte, bool bad) {
+	unsigned head = sci_rxhead;
+	u8 mask = 1 << (head & 7);
+
+	if (((head + 1) & SCI_RXBUF_MASK) == sci_rxtail) {
+		//full : drop byte, the frame is lost anyway
+		sci_rxerr |= SCI_RXERR_OVF;
+		return;
+	}
+	sci_rxbuf[head] = rxbyte;
+	if (bad) {
+		sci_rxbad[head / 8] |= mask;
+	} else {
+		sci_rxbad[head / 8] &= ~mask;
+	}
+	sci_rxhead = (head + 1) & SCI_RXBUF_MASK;
+	return;
+}
+
+/** RXI handler : move byte from RDR to the ring buffer */
+void sci_rxi(void) {
+	u8 rxbyte = NPK_SCI.RDR;
+
+	NPK_SCI.SSR.BIT.RDRF = 0;
+	sci_rxstore(rxbyte, 0);
+	return;
+}
+
+/** ERI handler : store the byte marked bad, and clear the error flags so RX can continue.
+ * The byte count is kept : the lost (ORER) or damaged (FER | PER) byte is still stored, but marked bad,
+ * so cmd_loop() knows where the current frame ends and can resync on the next one.
+ */
+void sci_eri(void) {
+	u8 ssr = NPK_SCI.SSR.BYTE;
+
+	if (ssr & 0x20) {
+		//ORER : RDR still holds the last good byte if RXI didn't get to it
+		if (ssr & 0x40) sci_rxstore(NPK_SCI.RDR, 0);
+		sci_rxstore(0, 1);
+	} else {
+		sci_rxstore(NPK_SCI.RDR, 1);
+	}
+	NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
+	return;
+}
+
+/** get next byte from ring buffer.
+ * @param bad : optional; set if the byte was received with an error
+ * @return 0 if empty
+ */
+static bool sci_rxget(u8 *dest, bool *bad) {
+	unsigned tail = sci_rxtail;
+
+	if (tail == sci_rxhead) return 0;
+	*dest = sci_rxbuf[tail];
+	if (bad) *bad = (sci_rxbad[tail / 8] >> (tail & 7)) & 1;
+	sci_rxtail = (tail + 1) & SCI_RXBUF_MASK;
+	return 1;
+}
+
+/** discard ring buffer contents and error flags */
+static void sci_rxflush(void) {
+	sci_rxtail = sci_rxhead;
+	sci_rxerr = 0;
+}
+
 /** discard RX data until idle for a given time
  * @param idle : purge until interbyte > idle ms
  *
@@ -104,15 +189,69 @@ static void sci_rxidle(unsigned ms) {
 		tc = get_mclk_ts();
 		if ((tc - t0) >= intv) return;
 
-		if (NPK_SCI.SSR.BYTE & 0x78) {
-			/* RDRF | ORER | FER | PER :reset timer */
+		if ((sci_rxtail != sci_rxhead) || sci_rxerr) {
+			/* new data or error : reset timer */
 			t0 = get_mclk_ts();
-			NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
+			sci_rxflush();
 		}
 	}
 }
 
-/** send a whole buffer, blocking. For use by iso_sendpkt() only */
+#ifdef WITH_TXIRQ
+/******* TX frame buffer
+ * iso_sendpkt() copies the complete frame here and returns; the SCI TXI interrupt then
+ * feeds TDR, so the caller can prepare the next packet (dump chunk etc) in parallel.
+ * TEI re-enables RX once the last stop bit is out.
+ */
+static u8 sci_txframe[2 + 255 + 1];	//FMT + LEN, payload, cks. Also fits a SID_DUMP_RAW_CHUNK + crc16
+static volatile unsigned sci_txpos;	//next byte to send
+static unsigned sci_txlen;
+static volatile bool sci_txbusy;	//set by iso_sendpkt(), cleared by sci_tei()
+
+/** TXI handler : TDR empty, send next byte */
+void sci_txi(void) {
+	unsigned pos = sci_txpos;
+
+	if (pos < sci_txlen) {
+		NPK_SCI.TDR = sci_txframe[pos];
+		NPK_SCI.SSR.BIT.TDRE = 0;		//start tx
+		pos += 1;
+		sci_txpos = pos;
+	}
+	if (pos >= sci_txlen) {
+		//last byte is in TDR : wait for TEND instead
+		NPK_SCI.SCR.BIT.TIE = 0;
+		NPK_SCI.SCR.BIT.TEIE = 1;
+	}
+	return;
+}
+
+/** TEI handler : frame completely sent. Re-enabling RX now won't pick up a partial byte */
+void sci_tei(void) {
+	NPK_SCI.SCR.BIT.TEIE = 0;
+	NPK_SCI.SCR.BIT.RE = 1;
+	sci_txbusy = 0;
+	return;
+}
+
+/** wait until the queued frame is completely sent */
+static void sci_txwait(void) {
+	while (sci_txbusy) {}
+}
+
+/** start sending the first len bytes of sci_txframe. Must have called sci_txwait() before filling it ! */
+static void sci_txstart(unsigned len) {
+	sci_txlen = len;
+	sci_txpos = 0;
+	sci_txbusy = 1;
+
+	NPK_SCI.SCR.BIT.RE = 0;
+	/* sci_txframe[] and sci_txlen aren't volatile : make sure they're stored before sci_txi() can run */
+	asm volatile ("" ::: "memory");
+	NPK_SCI.SCR.BIT.TIE = 1;	//TDRE is already set, so TXI fires right away
+}
+#else
+/******* polled TX : iso_sendpkt() returns once the frame is sent */
 static void sci_txblock(const uint8_t *buf, uint32_t len) {
 	for (; len > 0; len--) {
 		while (!NPK_SCI.SSR.BIT.TDRE) {}	//wait for empty
@@ -122,42 +261,107 @@ static void sci_txblock(const uint8_t *buf, uint32_t len) {
 	}
 }
 
+/** nothing queued, ever */
+static void sci_txwait(void) {}
+#endif
+
+#ifdef WITH_FASTDUMP
+/** send unframed data followed by its crc16 (big-endian), for SID_DUMP_ROMRAW.
+ * @param len <= SID_DUMP_RAW_CHUNK
+ *
+ * The crc is calculated before waiting for the previous chunk.
+ */
+static void sci_txraw_crc(const u8 *src, unsigned len) {
+	u16 crc = crc16(src, len);
+
+	sci_txwait();
+	memcpy(sci_txframe, src, len);
+	sci_txframe[len] = crc >> 8;
+	sci_txframe[len + 1] = crc & 0xFF;
+	sci_txstart(len + 2);
+}
+#endif
+
+#ifdef WITH_BATCH
+/* SID_BATCH : while running, responses are appended to batch_resp instead of being sent */
+static bool batch_active;
+static u8 batch_resp[256];
+static unsigned batch_len;
+static bool batch_fail;	//a sub-request got a negative response
+
+static void batch_add(const u8 *buf, unsigned len) {
+	if (buf[0] == 0x7F) batch_fail = 1;
+	if ((batch_len + 1 + len) > 0xFF) return;	//doesn't fit : dropped
+	batch_resp[batch_len++] = len;
+	memcpy(&batch_resp[batch_len], buf, len);
+	batch_len += len;
+}
+#endif
+
 /** Send a headerless iso14230 packet
  * @param len is clipped to 0xff
  *
  * disables RX during sending to remove halfdup echo. Should be reliable since
  * we re-enable after the stop bit, so K should definitely be back up to '1' again
  *
- * this is blocking
+ * With WITH_TXIRQ, only blocks until the previous packet is sent; otherwise blocks until this one is sent.
+ * Either way, *buf can be reused as soon as this returns.
  */
 static void iso_sendpkt(const uint8_t *buf, int len) {
-	u8 hdr[2];
+	unsigned hdrlen;
 	uint8_t cks;
+#ifndef WITH_TXIRQ
+	u8 hdr[2];
+#endif
 	if (len <= 0) return;
 
 	if (len > 0xff) len = 0xff;
 
+#ifdef WITH_BATCH
+	if (batch_active) {
+		batch_add(buf, len);
+		return;
+	}
+#endif
+
+	cks = len;
+	cks += cks_u8(buf, len);
+
+#ifdef WITH_TXIRQ
+	sci_txwait();
+
+	if (len <= 0x3F) {
+		sci_txframe[0] = (uint8_t) len;	//FMT/Len
+		hdrlen = 1;
+	} else {
+		sci_txframe[0] = 0;
+		sci_txframe[1] = (uint8_t) len;	//Len
+		hdrlen = 2;
+	}
+	memcpy(&sci_txframe[hdrlen], buf, len);	//Payload
+	sci_txframe[hdrlen + len] = cks;
+
+	sci_txstart(hdrlen + len + 1);
+#else
 	NPK_SCI.SCR.BIT.RE = 0;
 
 	if (len <= 0x3F) {
 		hdr[0] = (uint8_t) len;
-		sci_txblock(hdr, 1);	//FMT/Len
+		hdrlen = 1;	//FMT/Len
 	} else {
 		hdr[0] = 0;
 		hdr[1] = (uint8_t) len;
-		sci_txblock(hdr, 2);	//Len
+		hdrlen = 2;	//Len
 	}
-
+	sci_txblock(hdr, hdrlen);
 	sci_txblock(buf, len);	//Payload
-
-	cks = len;
-	cks += cks_u8(buf, len);
 	sci_txblock(&cks, 1);	//cks
 
-	//ugly : wait for transmission end; this means re-enabling RX won't pick up a partial byte
+	//wait for transmission end; this means re-enabling RX won't pick up a partial byte
 	while (!NPK_SCI.SSR.BIT.TEND) {}
 
 	NPK_SCI.SCR.BIT.RE = 1;
+#endif
 	return;
 }
 
@@ -261,19 +465,116 @@ static enum t_flashsm {
 	FL_READY,	//after doing init.
 } flashstate;
 
+/* deferred result of the last SIDFL_WBP write, as an NRC. 0 if ok */
+static u8 wbp_status;
+
+#ifdef WITH_WBL
+/* SIDFL_WBL stream : tail of the last frame, waiting for the rest of its page */
+static u8 wbl_carry[SIDFL_WB_DLEN] __attribute ((aligned (4)));
+static unsigned wbl_fill;	//# of bytes in wbl_carry
+static u32 wbl_addr;	//flash address of wbl_carry[0]
+
+/* SIDFL_SEGW / SIDFL_SEGC transfer state. Data goes through the SIDFL_WBL stream */
+static u32 seg_addr;	//dest address of next SIDFL_SEGC data
+static u32 seg_left;	//# of bytes still expected; 0 if no transfer in progress
+static u8 seg_seq;	//expected SEQ
+static u8 seg_err;	//NRC of first failure; following frames are ignored
+#endif
+
+#ifdef WITH_WBW
+/* SIDFL_WBW window : frames wbw_base ... (wbw_base + SIDFL_WBW_WIN - 1) */
+static u8 wbw_base;
+static u8 wbw_done;	//bit n set : frame (wbw_base + n) is programmed
+static u8 wbw_nrc[SIDFL_WBW_WIN];	//why frame (wbw_base + n) failed; 0 if not received
+#endif
+
+/* SIDFL_WBL pages are staged in fl_scratch during a SIDFL_EBA job */
+#if defined(WITH_WBL) && defined(WITH_EBA)
+	#define EBJ_STAGING
+#endif
+
+#if defined(WITH_LZ) || defined(WITH_DELTA) || defined(EBJ_STAGING)
+/* staging area for the flash commands that need more than one frame of RAM.
+ * Only one user at a time : SIDFL_WBZ, SIDFL_DELTA and SIDFL_COPY abort each other,
+ * and SIDFL_WBL pages are only staged here during a SIDFL_EBA job if nobody else is using it.
+ * Lives in .scratch, i.e. outside the payload and not zeroed at startup.
+ */
+static union {
+#ifdef WITH_LZ
+	u8 wbz[SIDFL_WBZ_MAXPAGES * SIDFL_WB_DLEN];	//SIDFL_WBZ decoded data
+#endif
+#ifdef WITH_DELTA
+	u8 delta[DELTA_BUFSIZE];	//SIDFL_DELTA block image
+	u8 copy[DELTA_BUFSIZE];	//SIDFL_COPY source data
+#endif
+#ifdef EBJ_STAGING
+	u8 stage[DELTA_BUFSIZE];	//SIDFL_WBL pages received during a SIDFL_EBA job
+#endif
+} fl_scratch __attribute ((aligned (4), section(".scratch")));
+#endif
+
+#ifdef WITH_DELTA
+static unsigned delta_block;	//block being rebuilt
+static unsigned delta_len;	//0 if none
+
+static unsigned copy_len;	//SIDFL_COPY data loaded; 0 if none
+#endif
+
+#ifdef WITH_JOURNAL
+/* reflash journal : what was erased, and programmed + verified, since the last SID_FLREQ.
+ * Survives link drops, so the host can resume after reconnecting.
+ */
+static u32 jrnl_erased;	//bit n set : block n
+static u8 jrnl_pages[ROMSIZE / SIDFL_WB_DLEN / 8];	//bit n set : page n
+#endif
+
+#ifdef WITH_EBA
+/* SIDFL_EBA background erase job, advanced by cmd_loop() while RX is idle */
+static u8 ebj_id;	//incremented for every job
+static u8 ebj_state;	//EBS_xx
+static u8 ebj_nrc;	//why the job failed
+static u8 ebj_steps;	//erase steps so far
+static unsigned ebj_block;
+static bool ebj_blank;	//job succeeded and nothing was written to ebj_block since
+#endif
+#ifdef EBJ_STAGING
+static u32 stg_addr;	//staged SIDFL_WBL pages, programmed when the job succeeds
+static unsigned stg_len;	//0 if none
+#endif
+
+#ifdef WITH_PROGRESS
+static u8 progress_intv;	//SID_CONF_PROGRESS interval, * 10 ms; 0 : disabled
+#endif
+
+#ifdef WITH_CMP
+/* SID_CONF_CMP state */
+static u32 cmp_addr;	//start address
+static u32 cmp_count;	//# of bytes compared
+static unsigned cmp_npages;	//highest page received + 1
+static bool cmp_ovf;	//some data was outside the bitmap
+static bool cmp_busy;	//some data was in the block being erased
+static u8 cmp_map[SID_CONF_CMP_MAXPAGES / 8];	//bit set : page differs
+#endif
+
 /* initialize command parser state machine;
  * updates SCI settings : 62500 bps
  * beware the FER error flag, it disables further RX. So when changing BRR, if the host sends a byte
  * FER will be set, etc.
  */
 
+static void sci_setbrr(u8 brrdiv) {
+	sci_txwait();	//finish sending any pending response at the old speed
+	NPK_SCI.SCR.BYTE &= 0x0B;	//disable TX + RX, and all SCI interrupts
+	NPK_SCI.BRR = brrdiv;		// speed = (div + 1) * 625k
+	NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
+	sci_rxflush();
+	NPK_SCI.SCR.BYTE |= 0x70;	//enable TX+RX, and RXI + ERI interrupts to fill the ring buffer
+}
+
 void cmd_init(u8 brrdiv) {
 	cmstate = CM_IDLE;
 	flashstate = FL_IDLE;
-	NPK_SCI.SCR.BYTE &= 0xCF;	//disable TX + RX
-	NPK_SCI.BRR = brrdiv;		// speed = (div + 1) * 625k
-	NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
-	NPK_SCI.SCR.BYTE |= 0x30;	//enable TX+RX , no RX interrupts for now
+	sci_setbrr(brrdiv);
 	return;
 }
 
@@ -351,6 +652,64 @@ static void cmd_dump(struct iso14230_msg *msg) {
 			addr += pktlen;
 		}
 		break;
+#ifdef WITH_FASTDUMP
+	case SID_DUMP_ROMSEG:
+		{
+		/* same as SID_DUMP_ROM, but announce the total length then send max-size frames */
+		u8 seq = 0;
+
+		txbuf[0] = SID_DUMP + 0x40;
+		txbuf[1] = len >> 16;
+		txbuf[2] = len >> 8;
+		txbuf[3] = len;
+		iso_sendpkt(txbuf, 4);
+		while (len) {
+			int pktlen;
+			pktlen = len;
+			if (pktlen > SID_DUMP_SEG_DLEN) pktlen = SID_DUMP_SEG_DLEN;
+			txbuf[1] = seq++;
+			memcpy(&txbuf[2], (void *) addr, pktlen);
+			iso_sendpkt(txbuf, pktlen + 2);
+			len -= pktlen;
+			addr += pktlen;
+		}
+		break;
+		}
+	case SID_DUMP_ROMRAW:
+		/* one header frame, then raw data with a crc16 after every chunk */
+		txbuf[0] = SID_DUMP + 0x40;
+		txbuf[1] = len >> 16;
+		txbuf[2] = len >> 8;
+		txbuf[3] = len;
+		iso_sendpkt(txbuf, 4);
+		while (len) {
+			unsigned chunklen;
+			chunklen = len;
+			if (chunklen > SID_DUMP_RAW_CHUNK) chunklen = SID_DUMP_RAW_CHUNK;
+			sci_txraw_crc((const u8 *) addr, chunklen);
+			len -= chunklen;
+			addr += chunklen;
+		}
+		break;
+#endif
+#ifdef WITH_LZ
+	case SID_DUMP_ROMLZ:
+		/* compress as much as fits in each frame */
+		txbuf[0] = SID_DUMP + 0x40;
+		while (len) {
+			unsigned srclen;
+			unsigned clen;
+			srclen = len;
+			if (srclen > LZ_MAXSRC) srclen = LZ_MAXSRC;
+			clen = lz_encode((const u8 *) addr, srclen, &txbuf[3], SID_DUMP_LZ_DLEN, &srclen);
+			txbuf[1] = srclen >> 8;
+			txbuf[2] = srclen & 0xFF;
+			iso_sendpkt(txbuf, clen + 3);
+			len -= srclen;
+			addr += srclen;
+		}
+		break;
+#endif
 	default:
 		tx_7F(SID_DUMP, ISO_NRC_SFNS_IF);
 		break;
@@ -364,6 +723,13 @@ static void cmd_dump(struct iso14230_msg *msg) {
 static void cmd_flash_init(void) {
 	u8 errval;
 
+#ifdef WITH_EBA
+	if (ebj_state == EBS_RUNNING) {
+		tx_7F(SID_FLREQ, ISO_NRC_BRR);
+		return;
+	}
+#endif
+
 	if (!platf_flash_init(&errval)) {
 		tx_7F(SID_FLREQ, errval);
 		return;
@@ -372,12 +738,180 @@ static void cmd_flash_init(void) {
 	txbuf[0] = (SID_FLREQ + 0x40);
 	iso_sendpkt(txbuf, 1);
 	flashstate = FL_READY;
+	wbp_status = 0;
+#ifdef WITH_JOURNAL
+	jrnl_erased = 0;
+	memset(jrnl_pages, 0, sizeof(jrnl_pages));
+#endif
+#ifdef WITH_WBL
+	wbl_fill = 0;
+	seg_left = 0;
+	seg_err = 0;
+#endif
+#ifdef WITH_WBW
+	wbw_base = 0;
+	wbw_done = 0;
+	memset(wbw_nrc, 0, sizeof(wbw_nrc));
+#endif
+#ifdef WITH_DELTA
+	delta_len = 0;
+	copy_len = 0;
+#endif
+#ifdef WITH_EBA
+	ebj_blank = 0;
+#endif
+	return;
+}
+
+#ifdef WITH_JOURNAL
+/* record a successful block erase in the journal. While protected, the drivers only pretend */
+static void jrnl_erase(unsigned blockno) {
+	u32 page;
+
+	if (!platf_flash_unprotected()) return;
+
+	jrnl_erased |= 1UL << blockno;
+	for (page = fblocks[blockno] / SIDFL_WB_DLEN; page < (fblocks[blockno + 1] / SIDFL_WB_DLEN); page++) {
+		jrnl_pages[page / 8] &= ~(1 << (page & 7));
+	}
+}
+
+/* record programmed pages in the journal. Only whole pages */
+static void jrnl_write(u32 dest, u32 len) {
+	u32 page;
+
+	if (!platf_flash_unprotected()) return;
+
+	for (page = (dest + SIDFL_WB_DLEN - 1) / SIDFL_WB_DLEN;
+			(page < ((dest + len) / SIDFL_WB_DLEN)) && (page < (ROMSIZE / SIDFL_WB_DLEN)); page++) {
+		jrnl_pages[page / 8] |= 1 << (page & 7);
+	}
+}
+#else
+static void jrnl_erase(unsigned blockno) {
+	(void) blockno;
+}
+
+static void jrnl_write(u32 dest, u32 len) {
+	(void) dest;
+	(void) len;
+}
+#endif
+
+/* platf_flash_eb_start() + _step() until done + journal + SID_CONF_PROGRESS frames */
+static u32 flash_eb(unsigned blockno) {
+	u32 rv;
+#ifdef WITH_PROGRESS
+	u32 t0;
+	unsigned pulses = 0;
+#endif
+
+	rv = platf_flash_eb_start(blockno);
+	if (rv) return rv;
+
+#ifdef WITH_PROGRESS
+	t0 = get_mclk_ts();
+#endif
+	while ((rv = platf_flash_eb_step()) == PFEB_BUSY) {
+#ifdef WITH_PROGRESS
+		pulses++;
+		if (!progress_intv) continue;
+#ifdef WITH_BATCH
+		if (batch_active) continue;
+#endif
+		if ((get_mclk_ts() - t0) >= MCLK_GETTS(progress_intv * 10)) {
+			u8 buf[4];
+			buf[0] = SID_CONF + 0x40;
+			buf[1] = SID_CONF_PROGRESS;
+			buf[2] = blockno;
+			buf[3] = (pulses > 0xFF)? 0xFF : pulses;
+			iso_sendpkt(buf, 4);
+			t0 = get_mclk_ts();
+		}
+#endif
+	}
+	if (rv) return rv;
+
+	jrnl_erase(blockno);
+	return 0;
+}
+
+/* platf_flash_wb() + journal */
+static u32 flash_wb(u32 dest, u32 src, u32 len) {
+	u32 rv;
+
+#ifdef WITH_EBA
+	if (ebj_blank && (dest < fblocks[ebj_block + 1]) && ((dest + len) > fblocks[ebj_block])) {
+		ebj_blank = 0;
+	}
+#endif
+	rv = platf_flash_wb(dest, src, len);
+	if (rv) return rv;
+	jrnl_write(dest, len);
+	return 0;
+}
+
+#ifdef WITH_EBA
+/* advance the SIDFL_EBA job by one step; program the staged pages once the block is erased */
+static void ebj_step(void) {
+	u32 rv;
+
+	rv = platf_flash_eb_step();
+	if (ebj_steps < 0xFF) ebj_steps++;
+	if (rv == PFEB_BUSY) return;
+
+	/* the ROM may have been read (and cached) during the erase */
+	romcrc_inval(fblocks[ebj_block], fblocks[ebj_block + 1] - fblocks[ebj_block]);
+	if (rv) goto failed;
+	jrnl_erase(ebj_block);
+	ebj_blank = platf_flash_unprotected();
+
+#ifdef EBJ_STAGING
+	if (stg_len) {
+		rv = flash_wb(stg_addr, (u32) fl_scratch.stage, stg_len);
+		stg_len = 0;
+		if (rv) goto failed;
+	}
+#endif
+	ebj_state = EBS_DONE;
 	return;
+
+failed:
+#ifdef EBJ_STAGING
+	stg_len = 0;
+#endif
+	ebj_nrc = (rv & 0xFF) | 0x80;
+	ebj_state = EBS_FAILED;
+}
+
+/* 1 if [addr, addr + len) overlaps the block being erased by the SIDFL_EBA job */
+static bool ebj_busy(u32 addr, u32 len) {
+	if (ebj_state != EBS_RUNNING) return 0;
+	return (addr < fblocks[ebj_block + 1]) && ((addr + len) > fblocks[ebj_block]);
+}
+#else
+static bool ebj_busy(u32 addr, u32 len) {
+	(void) addr;
+	(void) len;
+	return 0;
+}
+#endif
+
+#ifdef WITH_DELTA
+/* 1 if the last SIDFL_EBA job erased this block and nothing was written to it since */
+static bool ebj_isblank(unsigned blockno) {
+#ifdef WITH_EBA
+	return ebj_blank && (ebj_block == blockno);
+#else
+	(void) blockno;
+	return 0;
+#endif
 }
+#endif
 
 /* "one's complement" checksum; if adding causes a carry, add 1 to sum. Slightly better than simple 8bit sum
  */
-static u8 cks_add8(u8 *data, unsigned len) {
+static u8 cks_add8(const u8 *data, unsigned len) {
 	u16 sum = 0;
 	for (; len; len--, data++) {
 		sum += *data;
@@ -395,12 +929,9 @@ static int cmd_romcrc(const u8 *data) {
 	// <CNH> <CNL> <CRC0H> <CRC0L> ...<CRC3H> <CRC3L>
 	u16 chunkno = (*(data+0) << 8) | *(data+1);
 	for (idx = 0; idx < ROMCRC_NUMCHUNKS; idx++) {
-		u16 crc;
 		data += 2;
 		u16 test_crc = (*(data+0) << 8) | *(data+1);
-		u32 start = chunkno * ROMCRC_CHUNKSIZE;
-		crc = crc16((const u8 *)start, ROMCRC_CHUNKSIZE);
-		if (crc != test_crc) {
+		if (romcrc_get(chunkno) != test_crc) {
 			return -1;
 		}
 		chunkno += 1;
@@ -409,72 +940,992 @@ static int cmd_romcrc(const u8 *data) {
 	return 0;
 }
 
-/* handle low-level reflash commands */
-static void cmd_flash_utils(struct iso14230_msg *msg) {
-	u8 subcommand;
-	u32 tmp;
-
-	u32 rv = ISO_NRC_GR;
+#ifdef EBJ_STAGING
+/* 1 if SIDFL_DELTA or SIDFL_COPY data is loaded in fl_scratch */
+static bool scratch_taken(void) {
+#ifdef WITH_DELTA
+	return delta_len || copy_len;
+#else
+	return 0;
+#endif
+}
+#endif
 
-	if (flashstate != FL_READY) {
-		rv = ISO_NRC_CNCORSE;
-		goto exit_bad;
+#ifdef WITH_WBL
+/** program pages for flash_wbl(), or stage them if a SIDFL_EBA job is running.
+ * @return 0 if ok, NRC if failed
+ */
+static u32 wbl_prog(u32 addr, const u8 *src, unsigned len) {
+	u32 rv;
+
+#ifdef EBJ_STAGING
+	if (ebj_state == EBS_RUNNING) {
+		if (!stg_len) stg_addr = addr;
+		memcpy(&fl_scratch.stage[stg_len], src, len);
+		stg_len += len;
+		return 0;
 	}
+#endif
+	rv = flash_wb(addr, (u32) src, len);
+	if (rv) return (rv & 0xFF) | 0x80;
+	return 0;
+}
 
-	if (msg->datalen <= 1) {
-		rv = ISO_NRC_SFNS_IF;
-		goto exit_bad;
+/** SIDFL_WBL : append data to the write stream, and program every page it completes.
+ * Whole pages are written straight from *src, only the tail is copied.
+ *
+ * @return 0 if ok, NRC if failed. ISO_NRC_BRR leaves the stream untouched.
+ */
+static u32 flash_wbl(u32 addr, const u8 *src, unsigned len) {
+	u32 rv;
+	unsigned chunk;
+
+	if (wbl_fill) {
+		if (addr != (wbl_addr + wbl_fill)) return ISO_NRC_CNCORSE;	//not contiguous
+	} else if (addr & (SIDFL_WB_DLEN - 1)) {
+		return PFWB_MISALIGNED;
 	}
 
-	subcommand = msg->data[1];
+#ifdef EBJ_STAGING
+	if (ebj_state == EBS_RUNNING) {
+		/* pages this frame completes must fit in the staging area, after the ones already there */
+		u32 pstart = addr - wbl_fill;
+		unsigned plen = (wbl_fill + len) & ~(SIDFL_WB_DLEN - 1);
 
-	switch(subcommand) {
-	case SIDFL_EB:
-		//format : <SID_FLASH> <SIDFL_EB> <BLOCKNO>
-		if (msg->datalen != 3) {
-			rv = ISO_NRC_SFNS_IF;
-			goto exit_bad;
-		}
-		rv = platf_flash_eb(msg->data[2]);
-		if (rv) {
-			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
-			goto exit_bad;
-		}
-		break;
-	case SIDFL_WB:
-		//format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D127> <CRC>
-		if (msg->datalen != (SIDFL_WB_DLEN + 6)) {
-			rv = ISO_NRC_SFNS_IF;
-			goto exit_bad;
+		if (plen && (scratch_taken() ||
+				(stg_len && (pstart != (stg_addr + stg_len))) ||
+				((stg_len + plen) > sizeof(fl_scratch.stage)))) {
+			return ISO_NRC_BRR;
 		}
+	}
+#endif
 
-		if (cks_add8(&msg->data[2], (SIDFL_WB_DLEN + 3)) != msg->data[SIDFL_WB_DLEN + 5]) {
-			rv = SID_CONF_CKS1_BADCKS;	//crcerror
-			goto exit_bad;
-		}
+	if (wbl_fill) {
+		chunk = SIDFL_WB_DLEN - wbl_fill;
+		if (chunk > len) chunk = len;
+		memcpy(&wbl_carry[wbl_fill], src, chunk);
+		wbl_fill += chunk;
+		src += chunk;
+		len -= chunk;
+		if (wbl_fill < SIDFL_WB_DLEN) return 0;
+
+		wbl_fill = 0;
+		rv = wbl_prog(wbl_addr, wbl_carry, SIDFL_WB_DLEN);
+		if (rv) return rv;
+		addr = wbl_addr + SIDFL_WB_DLEN;
+	}
 
-		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
-		rv = platf_flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
-		if (rv) {
-			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
-			goto exit_bad;
-		}
-		break;
-	case SIDFL_UNPROTECT:
-		//format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
-		if (msg->datalen != 3) {
-			rv = ISO_NRC_SFNS_IF;
-			goto exit_bad;
-		}
-		if (msg->data[2] != (u8) ~SIDFL_UNPROTECT) {
-			rv = ISO_NRC_IK;	//InvalidKey
-			goto exit_bad;
-		}
+	chunk = len & ~(SIDFL_WB_DLEN - 1);
+	if (chunk) {
+		rv = wbl_prog(addr, src, chunk);
+		if (rv) return rv;
+		addr += chunk;
+		src += chunk;
+		len -= chunk;
+	}
 
-		platf_flash_unprotect();
-		break;
-	default:
-		rv = ISO_NRC_SFNS_IF;
+	memcpy(wbl_carry, src, len);
+	wbl_addr = addr;
+	wbl_fill = len;
+	return 0;
+}
+#endif
+
+#ifdef WITH_WBW
+/** SIDFL_WBW frame : program it if it's in the window. No response */
+static void flash_wbw(const struct iso14230_msg *msg) {
+	unsigned idx;
+	u32 dest;
+	u32 rv;
+
+	//format : <SID_FLASH> <SIDFL_WBW> <SEQ> <A2> <A1> <A0> <D0>...<D127> <CRC>
+	if (msg->datalen != (SIDFL_WB_DLEN + 7)) return;	//will be reported as lost
+
+	idx = (u8) (msg->data[2] - wbw_base);
+	if (idx >= SIDFL_WBW_WIN) return;	//out of window
+	if (wbw_done & (1 << idx)) return;	//duplicate
+
+	if (cks_add8(&msg->data[2], (SIDFL_WB_DLEN + 4)) != msg->data[SIDFL_WB_DLEN + 6]) {
+		wbw_nrc[idx] = SID_CONF_CKS1_BADCKS;
+		return;
+	}
+
+	dest = (msg->data[3] << 16) | (msg->data[4] << 8) | msg->data[5];
+	rv = flash_wb(dest, (u32) &msg->data[6], SIDFL_WB_DLEN);
+	if (rv) {
+		wbw_nrc[idx] = (rv & 0xFF) | 0x80;
+		return;
+	}
+	wbw_done |= (1 << idx);
+	return;
+}
+
+/** SIDFL_WBW poll : send cumulative ack + list of frames to re-send, and slide the window.
+ * @param nextseq : SEQ of the next frame the host would send
+ */
+static void flash_wbw_ack(u8 nextseq) {
+	unsigned pending;
+	unsigned idx;
+	unsigned respi;
+
+	pending = (u8) (nextseq - wbw_base);
+	if (pending > SIDFL_WBW_WIN) pending = SIDFL_WBW_WIN;
+
+	/* slide past the leading programmed frames */
+	for (idx = 0; (idx < pending) && (wbw_done & (1 << idx)); idx++) {}
+	wbw_base += idx;
+	wbw_done >>= idx;
+	pending -= idx;
+	memmove(wbw_nrc, &wbw_nrc[idx], SIDFL_WBW_WIN - idx);
+	memset(&wbw_nrc[SIDFL_WBW_WIN - idx], 0, idx);
+
+	txbuf[0] = SID_FLASH + 0x40;
+	txbuf[1] = wbw_base;
+	respi = 2;
+	for (idx = 0; idx < pending; idx++) {
+		if (wbw_done & (1 << idx)) continue;
+		txbuf[respi++] = wbw_base + idx;
+		txbuf[respi++] = wbw_nrc[idx];
+		wbw_nrc[idx] = 0;	//will be re-sent
+	}
+	iso_sendpkt(txbuf, respi);
+	return;
+}
+#endif
+
+#ifdef WITH_DELTA
+/** SIDFL_DELTA sub-functions.
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 flash_delta(const struct iso14230_msg *msg) {
+	const u8 *args = &msg->data[3];
+	unsigned nargs = msg->datalen - 3;
+	unsigned ofs;
+	unsigned len;
+	u32 start;
+	u32 rv;
+
+	if (msg->datalen < 3) return ISO_NRC_SFNS_IF;
+
+	switch (msg->data[2]) {
+	case DELTA_START:
+		//<BLOCK #>
+		if (nargs != 1) return ISO_NRC_SFNS_IF;
+#ifdef EBJ_STAGING
+		if (stg_len) return ISO_NRC_BRR;	//fl_scratch holds staged SIDFL_WBL pages
+#endif
+		delta_len = 0;
+		copy_len = 0;
+		if (args[0] >= fl_nblocks) return PFEB_BADBLOCK;
+		start = fblocks[args[0]];
+		len = fblocks[args[0] + 1] - start;
+		if (len > DELTA_BUFSIZE) return ISO_NRC_CNDTSA;
+		if (ebj_busy(start, len)) return ISO_NRC_BRR;
+		memcpy(fl_scratch.delta, (const void *) start, len);
+		delta_block = args[0];
+		delta_len = len;
+		return 0;
+	case DELTA_DATA:
+		//<OFSH> <OFSL> <D0>...<Dn-1>
+		if (!delta_len) return ISO_NRC_CNCORSE;
+		if (nargs < 3) return ISO_NRC_SFNS_IF;
+		ofs = (args[0] << 8) | args[1];
+		len = nargs - 2;
+		if ((ofs > delta_len) || (len > (delta_len - ofs))) return PFWB_OOB;
+		memcpy(&fl_scratch.delta[ofs], &args[2], len);
+		return 0;
+	case DELTA_COPY:
+		//<OFSH> <OFSL> <A2> <A1> <A0> <LENH> <LENL>
+		if (!delta_len) return ISO_NRC_CNCORSE;
+		if (nargs != 7) return ISO_NRC_SFNS_IF;
+		ofs = (args[0] << 8) | args[1];
+		start = (args[2] << 16) | (args[3] << 8) | args[4];
+		len = (args[5] << 8) | args[6];
+		if ((ofs > delta_len) || (len > (delta_len - ofs))) return PFWB_OOB;
+		if ((start >= ROMSIZE) || (len > (ROMSIZE - start))) return PFWB_OOB;	//ROM only
+		if (ebj_busy(start, len)) return ISO_NRC_BRR;
+		memcpy(&fl_scratch.delta[ofs], (const void *) start, len);
+		return 0;
+	case DELTA_COMMIT:
+		//<CRCH> <CRCL>
+		if (!delta_len) return ISO_NRC_CNCORSE;
+		if (nargs != 2) return ISO_NRC_SFNS_IF;
+		if (crc16(fl_scratch.delta, delta_len) != ((args[0] << 8) | args[1])) {
+			return SID_CONF_CKS1_BADCKS;	//block is left untouched
+		}
+		len = delta_len;
+		delta_len = 0;
+		if (!ebj_isblank(delta_block)) {
+			rv = flash_eb(delta_block);
+			if (rv) return (rv & 0xFF) | 0x80;
+		}
+		rv = flash_wb(fblocks[delta_block], (u32) fl_scratch.delta, len);
+		if (rv) return (rv & 0xFF) | 0x80;
+		return 0;
+	default:
+		break;
+	}
+	return ISO_NRC_SFNS_IF;
+}
+
+/** SIDFL_COPY sub-functions.
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 flash_copy(const struct iso14230_msg *msg) {
+	const u8 *args = &msg->data[3];
+	unsigned nargs = msg->datalen - 3;
+	u32 addr;
+	u32 len;
+	u32 rv;
+
+	if (msg->datalen < 3) return ISO_NRC_SFNS_IF;
+
+	switch (msg->data[2]) {
+	case COPY_LOAD:
+		//<S2> <S1> <S0> <L2> <L1> <L0>
+		if (nargs != 6) return ISO_NRC_SFNS_IF;
+		delta_len = 0;
+		copy_len = 0;
+		addr = (args[0] << 16) | (args[1] << 8) | args[2];
+		len = (args[3] << 16) | (args[4] << 8) | args[5];
+		if ((len == 0) || (len & (SIDFL_WB_DLEN - 1))) return PFWB_LEN;
+		if (len > sizeof(fl_scratch.copy)) return ISO_NRC_CNDTSA;
+		if ((addr + len) > ROMSIZE) return PFWB_OOB;
+		memcpy(fl_scratch.copy, (const void *) addr, len);
+		copy_len = len;
+		return 0;
+	case COPY_WRITE:
+		//<D2> <D1> <D0>
+		if (!copy_len) return ISO_NRC_CNCORSE;
+		if (nargs != 3) return ISO_NRC_SFNS_IF;
+		addr = (args[0] << 16) | (args[1] << 8) | args[2];
+		if (addr & (SIDFL_WB_DLEN - 1)) return PFWB_MISALIGNED;
+		rv = flash_wb(addr, (u32) fl_scratch.copy, copy_len);
+		if (rv) return (rv & 0xFF) | 0x80;
+		return 0;
+	default:
+		break;
+	}
+	return ISO_NRC_SFNS_IF;
+}
+#endif
+
+#ifdef WITH_CRCMAP
+/** SID_CONF_CRCMAP : send crc16 of every chunk in the range.
+ * data is the first byte after SID_CONF_CRCMAP
+ * @return 0 if ok, NRC if bad args
+ */
+static u32 cmd_crcmap(const u8 *data) {
+	// <A2> <A1> <A0> <L2> <L1> <L0> <CSZ>
+	u32 addr = (data[0] << 16) | (data[1] << 8) | data[2];
+	u32 len = (data[3] << 16) | (data[4] << 8) | data[5];
+	u32 chunksize;
+	unsigned respi;
+
+	if (data[6] > 4) return ISO_NRC_SFNS_IF;
+	chunksize = ROMCRC_CHUNKSIZE << data[6];
+	if ((len == 0) || ((addr | len) & (chunksize - 1))) return ISO_NRC_SFNS_IF;
+	if (ebj_busy(addr, len)) return ISO_NRC_BRR;
+
+	txbuf[0] = SID_CONF + 0x40;
+	respi = 1;
+	for (; len; len -= chunksize, addr += chunksize) {
+		u16 crc;
+		if (chunksize == ROMCRC_CHUNKSIZE) {
+			crc = romcrc_get(addr / ROMCRC_CHUNKSIZE);
+		} else {
+			crc = crc16((const u8 *) addr, chunksize);
+		}
+		txbuf[respi++] = crc >> 8;
+		txbuf[respi++] = crc & 0xFF;
+		if (respi == (1 + (2 * SID_CONF_CRCMAP_MAX))) {
+			iso_sendpkt(txbuf, respi);
+			respi = 1;
+		}
+	}
+	if (respi > 1) {
+		iso_sendpkt(txbuf, respi);
+	}
+	return 0;
+}
+#endif
+
+#if defined(WITH_CAPS) || defined(WITH_JOURNAL) || defined(WITH_CRCMAP)
+/* write big-endian u32 */
+static void put_u32(u8 *dst, u32 val) {
+	dst[0] = val >> 24;
+	dst[1] = val >> 16;
+	dst[2] = val >> 8;
+	dst[3] = val >> 0;
+}
+#endif
+
+#ifdef WITH_JOURNAL
+/** SID_CONF_JOURNAL : send part of the reflash journal, or page crcs.
+ * data is the first byte after SID_CONF_JOURNAL
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 cmd_journal(const u8 *data, unsigned len) {
+	unsigned page;
+	unsigned respi;
+
+	if ((len != 2) && (len != 3)) return ISO_NRC_SFNS_IF;
+	page = (data[0] << 8) | data[1];
+	if (page >= (ROMSIZE / SIDFL_WB_DLEN)) return ISO_NRC_SFNS_IF;
+
+	txbuf[0] = SID_CONF + 0x40;
+	if (len == 2) {
+		//<PH> <PL> : map
+		unsigned nbytes = sizeof(jrnl_pages) - (page / 8);
+
+		if (page & 7) return ISO_NRC_SFNS_IF;
+		if (nbytes > JOURNAL_MAPMAX) nbytes = JOURNAL_MAPMAX;
+		put_u32(&txbuf[1], jrnl_erased);
+		memcpy(&txbuf[5], &jrnl_pages[page / 8], nbytes);
+		respi = 5 + nbytes;
+	} else {
+		//<PH> <PL> <N> : crcs
+		unsigned npages = data[2];
+
+		if ((npages == 0) || (npages > JOURNAL_CRCMAX) ||
+			((page + npages) > (ROMSIZE / SIDFL_WB_DLEN))) return ISO_NRC_SFNS_IF;
+		if (ebj_busy(page * SIDFL_WB_DLEN, npages * SIDFL_WB_DLEN)) return ISO_NRC_BRR;
+		respi = 1;
+		for (; npages; npages--, page++) {
+			u16 crc = crc16((const u8 *) (page * SIDFL_WB_DLEN), SIDFL_WB_DLEN);
+			txbuf[respi++] = crc >> 8;
+			txbuf[respi++] = crc & 0xFF;
+		}
+	}
+	iso_sendpkt(txbuf, respi);
+	return 0;
+}
+#endif
+
+
+#ifdef WITH_SPEEDNEG
+static const u8 speedneg_pattern[SPEEDNEG_PLEN] = SPEEDNEG_PATTERN;
+
+/** receive the SID_CONF_SPEEDNEG probe.
+ * @return # of bit errors; missing bytes count as 8
+ */
+static unsigned speedneg_probe(void) {
+	u32 t0 = get_mclk_ts();
+	u32 intv = MCLK_GETTS(SPEEDNEG_TMO);
+	unsigned idx = 0;
+	unsigned errs = 0;
+
+	while ((idx < SPEEDNEG_PLEN) && ((get_mclk_ts() - t0) < intv)) {
+		u8 diff;
+		bool bad;
+		if (!sci_rxget(&diff, &bad)) continue;
+		if (bad) diff = ~speedneg_pattern[idx];	//count as 8 bit errors
+		for (diff ^= speedneg_pattern[idx++]; diff; diff &= diff - 1) {
+			errs++;
+		}
+	}
+	return errs + ((SPEEDNEG_PLEN - idx) * 8);
+}
+
+/** wait for the host's <SID_CONF> <SID_CONF_SPEEDNEG> confirmation. Reuses *msg
+ * @return 1 if received
+ */
+static bool speedneg_confirm(struct iso14230_msg *msg) {
+	u32 t0 = get_mclk_ts();
+	u32 intv = MCLK_GETTS(SPEEDNEG_TMO);
+
+	iso_clearmsg(msg);
+	while ((get_mclk_ts() - t0) < intv) {
+		enum iso_prc prv;
+		u8 rxbyte;
+		bool bad;
+
+		if (sci_rxerr) return 0;
+		if (!sci_rxget(&rxbyte, &bad)) continue;
+		if (bad) return 0;
+		prv = iso_parserx(msg, rxbyte);
+		if (prv == ISO_PRC_NEEDMORE) continue;
+		return (prv == ISO_PRC_DONE) && (msg->datalen == 2) &&
+			(msg->data[0] == SID_CONF) && (msg->data[1] == SID_CONF_SPEEDNEG);
+	}
+	return 0;
+}
+
+/* SID_CONF_SPEEDNEG : try every candidate BRR divisor until one passes the probe */
+static void cmd_speedneg(struct iso14230_msg *msg) {
+	u8 cand[SPEEDNEG_MAXCAND];
+	unsigned ncand = msg->datalen - 2;
+	unsigned idx;
+	u8 basediv = NPK_SCI.BRR;
+
+	if ((msg->datalen < 3) || (ncand > SPEEDNEG_MAXCAND)) {
+		tx_7F(SID_CONF, ISO_NRC_SFNS_IF);
+		return;
+	}
+	memcpy(cand, &msg->data[2], ncand);
+
+	txbuf[0] = SID_CONF + 0x40;
+	for (idx = 0; idx < ncand; idx++) {
+		unsigned errs;
+
+		txbuf[1] = cand[idx];
+		iso_sendpkt(txbuf, 2);
+		sci_setbrr(cand[idx]);
+
+		errs = speedneg_probe();
+		txbuf[2] = (errs > 0xFF) ? 0xFF : errs;
+		iso_sendpkt(txbuf, 3);
+		if ((errs == 0) && speedneg_confirm(msg)) {
+			iso_sendpkt(txbuf, 1);
+			return;
+		}
+
+		sci_setbrr(basediv);
+		sci_rxidle(SPEEDNEG_GAP);
+	}
+	tx_7F(SID_CONF, ISO_NRC_CNDTSA);
+}
+#endif
+
+#ifdef WITH_CAPS
+/* SIDs handled by cmd_dispatch(), for SID_CONF_CAPS */
+static const u8 caps_sids[] = {
+	SID_STARTCOMM, SID_RECUID, SID_CONF, SID_RESET, SID_RMBA, SID_WMBA,
+	SID_DUMP, SID_FLASH, SID_TP, SID_FLREQ,
+#ifdef WITH_BATCH
+	SID_BATCH,
+#endif
+};
+
+/* SID_CONF_CAPS : send kernel capabilities and flash geometry */
+static void cmd_caps(void) {
+	unsigned respi;
+	unsigned blockno;
+	u8 flags = 0;
+
+#ifdef ssmk
+	flags |= CAPS_F_SSM;
+#endif
+#ifdef ROMCRC_CACHE_ADDR
+	flags |= CAPS_F_CRCCACHE;
+#endif
+#ifdef DIAG_U16READ
+	flags |= CAPS_F_R16;
+#endif
+	if (fl_everify) flags |= CAPS_F_EVERIFY;
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = CAPS_VER;
+	txbuf[2] = flags;
+	txbuf[3] = fblocks[fl_nblocks] >> 16;
+	txbuf[4] = fblocks[fl_nblocks] >> 8;
+	txbuf[5] = fblocks[fl_nblocks] >> 0;
+	txbuf[6] = fl_wgran;
+	txbuf[7] = SIDFL_WB_DLEN;
+	put_u32(&txbuf[8], RAM_MIN);
+	put_u32(&txbuf[12], RAM_MAX);
+	txbuf[16] = SCI_RXBUF_SIZE >> 8;
+	txbuf[17] = SCI_RXBUF_SIZE & 0xFF;
+	memset(&txbuf[18], 0, 8);	//optional commands : 0 if not built in
+#ifdef WITH_WBL
+	txbuf[18] = SIDFL_WBL_MAXDLEN;
+#endif
+#ifdef WITH_WBW
+	txbuf[19] = SIDFL_WBW_WIN;
+#endif
+#ifdef WITH_LZ
+	txbuf[20] = SIDFL_WBZ_MAXPAGES;
+#endif
+#ifdef WITH_DELTA
+	txbuf[21] = DELTA_BUFSIZE >> 8;
+	txbuf[22] = DELTA_BUFSIZE & 0xFF;
+#endif
+#ifdef WITH_CMP
+	txbuf[23] = SID_CONF_CMP_MAXPAGES >> 8;
+	txbuf[24] = SID_CONF_CMP_MAXPAGES & 0xFF;
+#endif
+#ifdef WITH_CRCMAP
+	txbuf[25] = SID_CONF_CRCMAP_MAX;
+#endif
+	txbuf[26] = sizeof(caps_sids);
+	memcpy(&txbuf[27], caps_sids, sizeof(caps_sids));
+	respi = 27 + sizeof(caps_sids);
+
+	txbuf[respi++] = fl_nblocks;
+	for (blockno = 0; blockno < fl_nblocks; blockno++) {
+		txbuf[respi++] = fblocks[blockno] >> 16;
+		txbuf[respi++] = fblocks[blockno] >> 8;
+		txbuf[respi++] = fblocks[blockno] >> 0;
+	}
+	iso_sendpkt(txbuf, respi);
+}
+#endif
+
+#ifdef WITH_CMP
+/** SID_CONF_CMP sub-functions. Sends its own responses.
+ * @return 0 if ok, NRC otherwise
+ */
+static u32 cmd_cmp(const struct iso14230_msg *msg) {
+	const u8 *args = &msg->data[3];
+	unsigned nargs = msg->datalen - 3;
+	u32 ofs;
+	unsigned len;
+	unsigned respi;
+
+	if (msg->datalen < 3) return ISO_NRC_SFNS_IF;
+
+	switch (msg->data[2]) {
+	case CMP_START:
+		//<A2> <A1> <A0>
+		if (nargs != 3) return ISO_NRC_SFNS_IF;
+		cmp_addr = reconst_24(args);
+		if (cmp_addr & (SIDFL_WB_DLEN - 1)) return ISO_NRC_SFNS_IF;
+		cmp_count = 0;
+		cmp_npages = 0;
+		cmp_ovf = 0;
+		cmp_busy = 0;
+		memset(cmp_map, 0, sizeof(cmp_map));
+		txbuf[0] = SID_CONF + 0x40;
+		iso_sendpkt(txbuf, 1);
+		return 0;
+	case CMP_DATA:
+		//<O2> <O1> <O0> <D0>...<Dn-1> ; no response, errors are reported by CMP_END
+		if (nargs < 4) return 0;
+		ofs = (args[0] << 16) | (args[1] << 8) | args[2];
+		args += 3;
+		len = nargs - 3;
+		if ((ofs + len) > (SID_CONF_CMP_MAXPAGES * SIDFL_WB_DLEN)) {
+			cmp_ovf = 1;
+			return 0;
+		}
+		if (ebj_busy(cmp_addr + ofs, len)) {
+			cmp_busy = 1;
+			return 0;
+		}
+		cmp_count += len;
+		while (len) {
+			/* split on page boundaries */
+			unsigned page = ofs / SIDFL_WB_DLEN;
+			unsigned chunk = SIDFL_WB_DLEN - (ofs % SIDFL_WB_DLEN);
+			if (chunk > len) chunk = len;
+
+			if (memcmp((const void *) (cmp_addr + ofs), args, chunk) != 0) {
+				cmp_map[page / 8] |= 1 << (page & 7);
+			}
+			if (page >= cmp_npages) cmp_npages = page + 1;
+			ofs += chunk;
+			args += chunk;
+			len -= chunk;
+		}
+		return 0;
+	case CMP_END:
+		if (cmp_ovf) return ISO_NRC_CNDTSA;
+		if (cmp_busy) return ISO_NRC_BRR;
+		txbuf[0] = SID_CONF + 0x40;
+		txbuf[1] = cmp_count >> 16;
+		txbuf[2] = cmp_count >> 8;
+		txbuf[3] = cmp_count >> 0;
+		respi = (cmp_npages + 7) / 8;
+		memcpy(&txbuf[4], cmp_map, respi);
+		iso_sendpkt(txbuf, 4 + respi);
+		return 0;
+	default:
+		break;
+	}
+	return ISO_NRC_SFNS_IF;
+}
+#endif
+
+#ifdef WITH_CRCMAP
+/** SID_CONF_BLKCRC : send crc16 of every erase block */
+static void cmd_blkcrc(void) {
+	unsigned blockno;
+	unsigned respi;
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = fl_nblocks;
+	respi = 2;
+	for (blockno = 0; blockno < fl_nblocks; blockno++) {
+		u32 start = fblocks[blockno];
+		u16 crc = crc16((const u8 *) start, fblocks[blockno + 1] - start);
+		txbuf[respi++] = crc >> 8;
+		txbuf[respi++] = crc & 0xFF;
+	}
+	iso_sendpkt(txbuf, respi);
+}
+#endif
+
+#ifdef WITH_FILL
+/* SIDFL_FILL : program [dest, dest + len) with pat[0...plen-1] repeated,
+ * skipping pages that would stay blank. dest and len must be multiples of SIDFL_WB_DLEN.
+ *
+ * ret 0 if ok
+ */
+static u32 flash_fill(u32 dest, u32 len, const u8 *pat, unsigned plen) {
+	u8 page[SIDFL_WB_DLEN] __attribute ((aligned (4)));
+	unsigned pi = 0;	//pattern index of the next byte
+	u32 rv;
+
+	for (; len; len -= SIDFL_WB_DLEN, dest += SIDFL_WB_DLEN) {
+		unsigned i;
+		bool blank = 1;
+
+		for (i = 0; i < SIDFL_WB_DLEN; i++) {
+			page[i] = pat[pi];
+			if (page[i] != 0xFF) blank = 0;
+			if (++pi == plen) pi = 0;
+		}
+		if (blank) continue;
+
+		rv = flash_wb(dest, (u32) page, SIDFL_WB_DLEN);
+		if (rv) return rv;
+	}
+	return 0;
+}
+#endif
+
+#ifdef WITH_EBA
+/* SID_FLASH requests allowed while a SIDFL_EBA job runs : they only touch RAM,
+ * or (SIDFL_WBL, SEGx) stage their pages. Reads of the erasing block are refused further down.
+ */
+static bool ebj_allowed(const struct iso14230_msg *msg) {
+	switch (msg->data[1]) {
+#ifdef EBJ_STAGING
+	case SIDFL_WBL:
+	case SIDFL_SEGW:
+	case SIDFL_SEGC:
+		return 1;
+#endif
+#ifdef WITH_DELTA
+	case SIDFL_DELTA:
+		return (msg->datalen >= 3) && (msg->data[2] != DELTA_COMMIT);
+#endif
+	default:
+		break;
+	}
+	return 0;
+}
+#endif
+
+/* handle low-level reflash commands */
+static void cmd_flash_utils(struct iso14230_msg *msg) {
+	u8 subcommand;
+	u32 tmp;
+
+	u32 rv = ISO_NRC_GR;
+
+#ifdef WITH_EBA
+	if ((msg->datalen == 2) && (msg->data[1] == SIDFL_EBS)) {
+		//format : <SID_FLASH> <SIDFL_EBS> ; valid in any state
+		txbuf[0] = SID_FLASH + 0x40;
+		txbuf[1] = ebj_id;
+		txbuf[2] = ebj_state;
+		txbuf[3] = ebj_nrc;
+		txbuf[4] = ebj_steps;
+		iso_sendpkt(txbuf, 5);
+		return;
+	}
+#endif
+
+	if (flashstate != FL_READY) {
+		rv = ISO_NRC_CNCORSE;
+		goto exit_bad;
+	}
+
+	if (msg->datalen <= 1) {
+		rv = ISO_NRC_SFNS_IF;
+		goto exit_bad;
+	}
+
+	subcommand = msg->data[1];
+
+#ifdef WITH_EBA
+	if ((ebj_state == EBS_RUNNING) && !ebj_allowed(msg)) {
+		//only requests that don't program while an erase is running
+		rv = ISO_NRC_BRR;
+		goto exit_bad;
+	}
+#endif
+
+	switch(subcommand) {
+	case SIDFL_EB:
+		//format : <SID_FLASH> <SIDFL_EB> <BLOCKNO>
+		if (msg->datalen != 3) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		rv = flash_eb(msg->data[2]);
+		if (rv) {
+			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+			goto exit_bad;
+		}
+		break;
+	case SIDFL_WBP:
+		if (wbp_status) {
+			//previous block failed : report it now, and drop this one.
+			rv = wbp_status;
+			wbp_status = 0;
+			goto exit_bad;
+		}
+		if (msg->datalen == 2) {
+			//format : <SID_FLASH> <SIDFL_WBP> : just a status query
+			break;
+		}
+		/* Fallthrough */
+	case SIDFL_WB:
+		//format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D127> <CRC>
+		if (msg->datalen != (SIDFL_WB_DLEN + 6)) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+
+		if (cks_add8(&msg->data[2], (SIDFL_WB_DLEN + 3)) != msg->data[SIDFL_WB_DLEN + 5]) {
+			rv = SID_CONF_CKS1_BADCKS;	//crcerror
+			goto exit_bad;
+		}
+
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		if (subcommand == SIDFL_WBP) {
+			/* ack before programming, so the host can send the next block
+			 * while this one is written. Status is reported on the next SIDFL_WBP. */
+			txbuf[0] = SID_FLASH + 0x40;
+			iso_sendpkt(txbuf, 1);
+			rv = flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
+			if (rv) {
+				wbp_status = (rv & 0xFF) | 0x80;
+			}
+			return;
+		}
+		rv = flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
+		if (rv) {
+			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+			goto exit_bad;
+		}
+		break;
+#ifdef WITH_WBL
+	case SIDFL_WBL:
+		if (msg->datalen == 2) {
+			//format : <SID_FLASH> <SIDFL_WBL> : report max payload
+			txbuf[0] = SID_FLASH + 0x40;
+			txbuf[1] = SIDFL_WBL_MAXDLEN;
+			txbuf[2] = wbl_fill;
+			iso_sendpkt(txbuf, 3);
+			return;
+		}
+		//format : <SID_FLASH> <SIDFL_WBL> <A2> <A1> <A0> <D0>...<Dn-1> <CRC>
+		if (msg->datalen < 7) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		if (cks_add8(&msg->data[2], msg->datalen - 3) != msg->data[msg->datalen - 1]) {
+			rv = SID_CONF_CKS1_BADCKS;	//crcerror; stream state unchanged so the frame can be re-sent
+			goto exit_bad;
+		}
+
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		rv = flash_wbl(tmp, &msg->data[5], msg->datalen - 6);
+		if (rv) {
+			if (rv != ISO_NRC_BRR) wbl_fill = 0;	//BRR : re-send the same frame later
+			goto exit_bad;
+		}
+		break;
+	case SIDFL_SEGW:
+		if (msg->datalen == 2) {
+			//format : <SID_FLASH> <SIDFL_SEGW> : status query, ends the transfer
+			tmp = seg_addr - wbl_fill;	//the carry isn't programmed yet
+			txbuf[0] = SID_FLASH + 0x40;
+			txbuf[1] = seg_err;
+			txbuf[2] = tmp >> 16;
+			txbuf[3] = tmp >> 8;
+			txbuf[4] = tmp;
+			iso_sendpkt(txbuf, 5);
+			seg_left = 0;
+			seg_err = 0;
+			wbl_fill = 0;
+			return;
+		}
+		//format : <SID_FLASH> <SIDFL_SEGW> <A2> <A1> <A0> <L2> <L1> <L0>
+		if (msg->datalen != 8) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		tmp = (msg->data[5] << 16) | (msg->data[6] << 8) | msg->data[7];
+		if ((tmp == 0) || (tmp & (SIDFL_WB_DLEN - 1))) {
+			rv = PFWB_LEN;
+			goto exit_bad;
+		}
+		seg_addr = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		if (seg_addr & (SIDFL_WB_DLEN - 1)) {
+			rv = PFWB_MISALIGNED;
+			goto exit_bad;
+		}
+		seg_left = tmp;
+		seg_seq = 0;
+		seg_err = 0;
+		wbl_fill = 0;
+		break;
+	case SIDFL_SEGC:
+		//format : <SID_FLASH> <SIDFL_SEGC> <SEQ> <D0>...<Dn-1> <CRC>
+		if (!seg_left) {
+			rv = ISO_NRC_CNCORSE;
+			goto exit_bad;
+		}
+		if (seg_err) return;	//already failed; wait for status query
+
+		tmp = msg->datalen - 4;	//# of data bytes
+		if ((msg->datalen < 5) || (tmp > seg_left)) {
+			seg_err = ISO_NRC_SFNS_IF;
+			return;
+		}
+		if (cks_add8(&msg->data[2], tmp + 1) != msg->data[msg->datalen - 1]) {
+			seg_err = SID_CONF_CKS1_BADCKS;
+			return;
+		}
+		if (msg->data[2] != seg_seq) {
+			seg_err = ISO_NRC_CNCORSE;	//lost a frame
+			return;
+		}
+		rv = flash_wbl(seg_addr, &msg->data[3], tmp);
+		if (rv) {
+			seg_err = rv;
+			return;
+		}
+		seg_addr += tmp;
+		seg_left -= tmp;
+		seg_seq += 1;
+		if (seg_left) return;	//no response until complete
+		break;
+#endif
+#ifdef WITH_WBW
+	case SIDFL_WBW:
+		if (msg->datalen == 3) {
+			//format : <SID_FLASH> <SIDFL_WBW> <NEXTSEQ>
+			flash_wbw_ack(msg->data[2]);
+		} else {
+			flash_wbw(msg);
+		}
+		return;
+#endif
+#ifdef WITH_LZ
+	case SIDFL_WBZ:
+		{
+		//format : <SID_FLASH> <SIDFL_WBZ> <A2> <A1> <A0> <NP> <CRCH> <CRCL> <C0>...<Cn-1> <CKS>
+		unsigned declen;
+		u16 crc;
+
+		if (msg->datalen < 10) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		if (cks_add8(&msg->data[2], msg->datalen - 3) != msg->data[msg->datalen - 1]) {
+			rv = SID_CONF_CKS1_BADCKS;
+			goto exit_bad;
+		}
+#ifdef WITH_DELTA
+		delta_len = 0;	//shares fl_scratch with SIDFL_DELTA and SIDFL_COPY
+		copy_len = 0;
+#endif
+		declen = msg->data[5] * SIDFL_WB_DLEN;
+		if ((declen == 0) || (declen > sizeof(fl_scratch.wbz)) ||
+			(lz_decode(&msg->data[8], msg->datalen - 9, fl_scratch.wbz, declen) != (int) declen)) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		crc = crc16(fl_scratch.wbz, declen);
+		if (crc != ((msg->data[6] << 8) | msg->data[7])) {
+			rv = SID_CONF_CKS1_BADCKS;
+			goto exit_bad;
+		}
+
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		rv = flash_wb(tmp, (u32) fl_scratch.wbz, declen);
+		if (rv) {
+			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+			goto exit_bad;
+		}
+		break;
+		}
+#endif
+#ifdef WITH_DELTA
+	case SIDFL_DELTA:
+		//format : <SID_FLASH> <SIDFL_DELTA> <DELTA_xx> ...
+		rv = flash_delta(msg);
+		if (rv) goto exit_bad;
+		break;
+	case SIDFL_COPY:
+		//format : <SID_FLASH> <SIDFL_COPY> <COPY_xx> ...
+		rv = flash_copy(msg);
+		if (rv) goto exit_bad;
+		break;
+#endif
+#ifdef WITH_EBA
+	case SIDFL_EBA:
+		//format : <SID_FLASH> <SIDFL_EBA> <BLOCKNO>
+		if (msg->datalen != 3) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		rv = platf_flash_eb_start(msg->data[2]);
+		if (rv) {
+			rv = (rv & 0xFF) | 0x80;
+			goto exit_bad;
+		}
+		ebj_id++;
+		ebj_block = msg->data[2];
+		ebj_steps = 0;
+		ebj_nrc = 0;
+		ebj_blank = 0;
+		ebj_state = EBS_RUNNING;
+		txbuf[0] = SID_FLASH + 0x40;
+		txbuf[1] = ebj_id;
+		iso_sendpkt(txbuf, 2);
+		return;
+#endif
+#ifdef WITH_FILL
+	case SIDFL_FILL:
+		//format : <SID_FLASH> <SIDFL_FILL> <A2> <A1> <A0> <L2> <L1> <L0> <P0>...<Pn-1>
+		if ((msg->datalen < 9) || (msg->datalen > (8 + SIDFL_FILL_MAXPAT))) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		{
+		u32 len = (msg->data[5] << 16) | (msg->data[6] << 8) | msg->data[7];
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		if ((len == 0) || (len & (SIDFL_WB_DLEN - 1))) {
+			rv = PFWB_LEN;
+			goto exit_bad;
+		}
+		if (tmp & (SIDFL_WB_DLEN - 1)) {
+			rv = PFWB_MISALIGNED;
+			goto exit_bad;
+		}
+		if ((tmp + len) > ROMSIZE) {
+			rv = PFWB_OOB;
+			goto exit_bad;
+		}
+		rv = flash_fill(tmp, len, &msg->data[8], msg->datalen - 8);
+		if (rv) {
+			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+			goto exit_bad;
+		}
+		}
+		break;
+#endif
+	case SIDFL_UNPROTECT:
+		//format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
+		if (msg->datalen != 3) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		if (msg->data[2] != (u8) ~SIDFL_UNPROTECT) {
+			rv = ISO_NRC_IK;	//InvalidKey
+			goto exit_bad;
+		}
+
+		platf_flash_unprotect();
+		break;
+	default:
+		rv = ISO_NRC_SFNS_IF;
 		goto exit_bad;
 		break;
 	}
@@ -490,6 +1941,59 @@ exit_bad:
 
 
 /* ReadMemByAddress */
+#ifdef WITH_RMBA_SG
+/** scatter-gather SID_RMBA.
+ * @return 0 if ok
+ */
+static int cmd_rmba_sg(const struct iso14230_msg *msg) {
+	//format : <SID_RMBA> <N> N * (<AH> <AM> <AL> <SZ>)
+	/* response : <SID + 0x40> <D0>....<Dn> */
+	const u8 *tuple = &msg->data[2];
+	unsigned nranges = msg->data[1];
+	unsigned respi = 1;
+
+	if ((nranges == 0) || (msg->datalen != (int) (2 + (4 * nranges)))) return -1;
+
+	txbuf[0] = SID_RMBA + 0x40;
+	for (; nranges; nranges--, tuple += 4) {
+		u32 addr = reconst_24(tuple);
+		unsigned siz = tuple[3] & RMBA_SG_MAXSIZ;
+
+		if ((siz == 0) || ((respi + siz) > (1 + RMBA_SG_MAXTOT))) return -1;
+
+		switch (tuple[3] & RMBA_SG_WMASK) {
+		case RMBA_SG_W8:
+			memcpy(&txbuf[respi], (const void *) addr, siz);
+			respi += siz;
+			break;
+		case RMBA_SG_W16:
+			if ((addr | siz) & 1) return -1;
+			for (; siz; siz -= 2, addr += 2) {
+				u16 val = *(volatile const u16 *) addr;
+				txbuf[respi++] = val >> 8;
+				txbuf[respi++] = val & 0xFF;
+			}
+			break;
+		case RMBA_SG_W32:
+			if ((addr | siz) & 3) return -1;
+			for (; siz; siz -= 4, addr += 4) {
+				u32 val = *(volatile const u32 *) addr;
+				txbuf[respi++] = val >> 24;
+				txbuf[respi++] = val >> 16;
+				txbuf[respi++] = val >> 8;
+				txbuf[respi++] = val & 0xFF;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	iso_sendpkt(txbuf, respi);
+	return 0;
+}
+#endif
+
 static void cmd_rmba(struct iso14230_msg *msg) {
 	//format : <SID_RMBA> <AH> <AM> <AL> <SIZ>
 	/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
@@ -497,6 +2001,13 @@ static void cmd_rmba(struct iso14230_msg *msg) {
 	u32 addr;
 	int siz;
 
+#ifdef WITH_RMBA_SG
+	if ((msg->datalen & 1) == 0) {
+		if (cmd_rmba_sg(msg)) goto bad12;
+		return;
+	}
+#endif
+
 	if (msg->datalen != 5) goto bad12;
 	siz = msg->data[4];
 
@@ -561,7 +2072,7 @@ badexit:
 
 /* set & configure kernel */
 static void cmd_conf(struct iso14230_msg *msg) {
-	u8 resp[4];
+	u8 resp[5];
 	u32 tmp;
 
 	resp[0] = SID_CONF + 0x40;
@@ -588,6 +2099,11 @@ static void cmd_conf(struct iso14230_msg *msg) {
 		if (msg->datalen != 12) {
 			goto bad12;
 		}
+		tmp = ((msg->data[2] << 8) | msg->data[3]) * ROMCRC_CHUNKSIZE;
+		if (ebj_busy(tmp, ROMCRC_NUMCHUNKS * ROMCRC_CHUNKSIZE)) {
+			tx_7F(SID_CONF, ISO_NRC_BRR);
+			return;
+		}
 		if (cmd_romcrc(&msg->data[2])) {
 			tx_7F(SID_CONF, SID_CONF_CKS1_BADCKS);
 			return;
@@ -601,6 +2117,79 @@ static void cmd_conf(struct iso14230_msg *msg) {
 		iso_sendpkt(resp, 2);
 		return;
 		break;
+#ifdef WITH_CRCMAP
+	case SID_CONF_CRCMAP:
+		//<SID_CONF> <SID_CONF_CRCMAP> <A2> <A1> <A0> <L2> <L1> <L0> <CSZ>
+		if (msg->datalen != 9) goto bad12;
+		tmp = cmd_crcmap(&msg->data[2]);
+		if (tmp) tx_7F(SID_CONF, tmp);
+		return;
+		break;
+	case SID_CONF_BLKCRC:
+		if (ebj_busy(0, ROMSIZE)) {
+			tx_7F(SID_CONF, ISO_NRC_BRR);
+			return;
+		}
+		cmd_blkcrc();
+		return;
+		break;
+#endif
+#ifdef WITH_CMP
+	case SID_CONF_CMP:
+		tmp = cmd_cmp(msg);
+		if (tmp) tx_7F(SID_CONF, tmp);
+		return;
+		break;
+#endif
+#ifdef WITH_CAPS
+	case SID_CONF_CAPS:
+		cmd_caps();
+		return;
+		break;
+#endif
+#ifdef WITH_SPEEDNEG
+	case SID_CONF_SPEEDNEG:
+		cmd_speedneg(msg);
+		return;
+		break;
+#endif
+#ifdef WITH_JOURNAL
+	case SID_CONF_JOURNAL:
+		//<SID_CONF> <SID_CONF_JOURNAL> <PH> <PL> [<N>]
+		tmp = cmd_journal(&msg->data[2], msg->datalen - 2);
+		if (tmp) tx_7F(SID_CONF, tmp);
+		return;
+		break;
+#endif
+#ifdef WITH_PROGRESS
+	case SID_CONF_PROGRESS:
+		//<SID_CONF> <SID_CONF_PROGRESS> <INTV>
+		if (msg->datalen != 3) goto bad12;
+		progress_intv = msg->data[2];
+		iso_sendpkt(resp, 1);
+		return;
+		break;
+#endif
+#ifdef WITH_CRCMAP
+	case SID_CONF_CRC32:
+		{
+		u32 len;
+		//<SID_CONF> <SID_CONF_CRC32> <A2> <A1> <A0> <L2> <L1> <L0>
+		if (msg->datalen != 8) goto bad12;
+		tmp = reconst_24(&msg->data[2]);
+		len = (msg->data[5] << 16) | (msg->data[6] << 8) | msg->data[7];
+		if (len == 0) goto bad12;
+		if (ebj_busy(tmp, len)) {
+			tx_7F(SID_CONF, ISO_NRC_BRR);
+			return;
+		}
+		tmp = crc32((const u8 *) tmp, len);
+		put_u32(&resp[1], tmp);
+		iso_sendpkt(resp, 5);
+		return;
+		break;
+		}
+#endif
 #ifdef DIAG_U16READ
 	case SID_CONF_R16:
 		{
@@ -627,6 +2216,118 @@ bad12:
 }
 
 
+#ifdef WITH_BATCH
+static void cmd_batch(const struct iso14230_msg *msg);
+#endif
+
+/* run one request; only in CM_READY state */
+static void cmd_dispatch(struct iso14230_msg *msg) {
+	switch (msg->data[0]) {
+	case SID_STARTCOMM:
+		cmd_startcomm();
+		break;
+	case SID_RECUID:
+		iso_sendpkt(npk_ver_string, sizeof(npk_ver_string));
+		break;
+	case SID_CONF:
+		cmd_conf(msg);
+		break;
+	case SID_RESET:
+		/* ECUReset */
+		txbuf[0] = msg->data[0] + 0x40;
+		iso_sendpkt(txbuf, 1);
+		sci_txwait();
+		die();
+		break;
+	case SID_RMBA:
+		cmd_rmba(msg);
+		break;
+	case SID_WMBA:
+		cmd_wmba(msg);
+		break;
+	case SID_DUMP:
+		cmd_dump(msg);
+		break;
+	case SID_FLASH:
+		cmd_flash_utils(msg);
+		break;
+	case SID_TP:
+		txbuf[0] = msg->data[0] + 0x40;
+		iso_sendpkt(txbuf, 1);
+		break;
+	case SID_FLREQ:
+		cmd_flash_init();
+		break;
+#ifdef WITH_BATCH
+	case SID_BATCH:
+		cmd_batch(msg);
+		break;
+#endif
+	default:
+		tx_7F(msg->data[0], ISO_NRC_SNS);
+		break;
+	}	//switch (SID)
+}
+
+#ifdef WITH_BATCH
+/* SID_BATCH : run every sub-request, collecting the responses */
+static void cmd_batch(const struct iso14230_msg *msg) {
+	static struct iso14230_msg sub;
+	const u8 *req = &msg->data[1];
+	int left = msg->datalen - 1;
+	u8 nreq = 0;
+
+	if (batch_active) {
+		//no nesting
+		tx_7F(SID_BATCH, ISO_NRC_SFNS_IF);
+		return;
+	}
+
+	batch_resp[0] = SID_BATCH + 0x40;
+	batch_len = 2;
+	batch_fail = 0;
+	batch_active = 1;
+
+	while ((left > 0) && !batch_fail) {
+		unsigned sublen = req[0];
+
+		if ((sublen == 0) || ((int) sublen >= left)) {
+			tx_7F(SID_BATCH, ISO_NRC_SFNS_IF);
+			nreq++;
+			break;
+		}
+		iso_clearmsg(&sub);
+		memcpy(sub.data, &req[1], sublen);
+		sub.datalen = sublen;
+		nreq++;
+
+		switch (sub.data[0]) {
+		case SID_DUMP:
+		case SID_RESET:
+			//multi-frame / no return
+			tx_7F(sub.data[0], ISO_NRC_SFNS_IF);
+			break;
+		case SID_CONF:
+			if ((sublen >= 2) &&
+				((sub.data[1] == SID_CONF_SETSPEED) || (sub.data[1] == SID_CONF_SPEEDNEG))) {
+				tx_7F(sub.data[0], ISO_NRC_SFNS_IF);
+				break;
+			}
+			//fallthru
+		default:
+			cmd_dispatch(&sub);
+			break;
+		}
+		req += 1 + sublen;
+		left -= 1 + sublen;
+	}
+
+	batch_active = 0;
+	batch_resp[1] = nreq;
+	iso_sendpkt(batch_resp, batch_len);
+}
+#endif
+
 /* command parser; infinite loop waiting for commands.
  * not sure if it's worth the trouble to make this async,
  * what other tasks could run in background ? reflash shit ?
@@ -638,29 +2339,53 @@ void cmd_loop(void) {
 
 	static struct iso14230_msg msg;
 
-	//u32 t_last, t_cur;	//timestamps
+	u32 t_last = 0;	//timestamp of the last byte of an incomplete frame
+	bool msg_bad = 0;	//current frame has a byte received with ORER | FER | PER
 
 	iso_clearmsg(&msg);
 
 	while (1) {
 		enum iso_prc prv;
+		bool rxbad;
 
-		/* in case of errors (ORER | FER | PER), reset state mach. */
-		if (NPK_SCI.SSR.BYTE & 0x38) {
-
-			cmstate = CM_IDLE;
-			flashstate = FL_IDLE;
+		/* Session and flash state are kept after comms errors; the host only needs to retransmit.
+		 * A ring buffer overflow loses bytes, so drop everything and resync after an idle period.
+		 */
+		if (sci_rxerr & SCI_RXERR_OVF) {
 			iso_clearmsg(&msg);
+			msg_bad = 0;
 			sci_rxidle(MAX_INTERBYTE);
 			continue;
 		}
 
-		if (!NPK_SCI.SSR.BIT.RDRF) continue;
+		if (!sci_rxget(&rxbyte, &rxbad)) {
+			if (msg.hi && ((get_mclk_ts() - t_last) >= MCLK_GETTS(MAX_INTERBYTE))) {
+				/* interrupted frame, or we lost a byte : next byte must be a new header */
+				iso_clearmsg(&msg);
+				msg_bad = 0;
+			}
+#ifdef WITH_EBA
+			if (ebj_state == EBS_RUNNING) {
+				ebj_step();
+				continue;
+			}
+#endif
+			romcrc_idle();
+			continue;
+		}
 
-		rxbyte = NPK_SCI.RDR;
-		NPK_SCI.SSR.BIT.RDRF = 0;
+		t_last = get_mclk_ts();
 
-		//t_cur = get_mclk_ts();	/* XXX TODO : filter out interrupted messages with t>5ms interbyte ? */
+		if (rxbad) {
+			if (!msg.hi || (msg.hi != msg.hdrlen)) {
+				/* in the header : the frame length can't be trusted */
+				iso_clearmsg(&msg);
+				msg_bad = 0;
+				sci_rxidle(MAX_INTERBYTE);
+				continue;
+			}
+			msg_bad = 1;
+		}
 
 		/* got a byte; parse according to state */
 		prv = iso_parserx(&msg, rxbyte);
@@ -668,9 +2393,20 @@ void cmd_loop(void) {
 		if (prv == ISO_PRC_NEEDMORE) {
 			continue;
 		}
+		if (msg_bad) {
+			/* damaged frame is complete : drop it. The next byte is the header of the next frame,
+			 * so frames the host already queued behind it are still processed. */
+			iso_clearmsg(&msg);
+			msg_bad = 0;
+			continue;
+		}
 		if (prv != ISO_PRC_DONE) {
+			/* bad checksum : the length was good, so like above, only this frame is dropped.
+			 * A bad FMT byte (msg.hi still 0) means we're not on a frame boundary : resync. */
+			bool hdr_err = !msg.hi;
+
 			iso_clearmsg(&msg);
-			sci_rxidle(MAX_INTERBYTE);
+			if (hdr_err) sci_rxidle(MAX_INTERBYTE);
 			continue;
 		}
 		/* here, we have a complete iso frame */
@@ -686,55 +2422,8 @@ void cmd_loop(void) {
 			break;
 
 		case CM_READY:
-			switch (msg.data[0]) {
-			case SID_STARTCOMM:
-				cmd_startcomm();
-				iso_clearmsg(&msg);
-				break;
-			case SID_RECUID:
-				iso_sendpkt(npk_ver_string, sizeof(npk_ver_string));
-				iso_clearmsg(&msg);
-				break;
-			case SID_CONF:
-				cmd_conf(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_RESET:
-				/* ECUReset */
-				txbuf[0] = msg.data[0] + 0x40;
-				iso_sendpkt(txbuf, 1);
-				die();
-				break;
-			case SID_RMBA:
-				cmd_rmba(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_WMBA:
-				cmd_wmba(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_DUMP:
-				cmd_dump(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_FLASH:
-				cmd_flash_utils(&msg);
-				iso_clearmsg(&msg);
-				break;
-			case SID_TP:
-				txbuf[0] = msg.data[0] + 0x40;
-				iso_sendpkt(txbuf, 1);
-				iso_clearmsg(&msg);
-				break;
-			case SID_FLREQ:
-				cmd_flash_init();
-				iso_clearmsg(&msg);
-				break;
-			default:
-				tx_7F(msg.data[0], ISO_NRC_SNS);
-				iso_clearmsg(&msg);
-				break;
-			}	//switch (SID)
+			cmd_dispatch(&msg);
+			iso_clearmsg(&msg);
 			break;
 		default :
 			//invalid state, or nothing special to do
@@ -22,3 +22,15 @@
 void cmd_init(u8 brrdiv);
 
 void cmd_loop(void);
+
+/** SCI receive handlers, called from the RXI / ERI interrupts installed by build_ivt().
+ * These fill the RX ring buffer drained by cmd_loop().
+ */
+void sci_rxi(void);
+void sci_eri(void);
+
+/** SCI transmit handlers, called from the TXI / TEI interrupts.
+ * These send the frame queued by iso_sendpkt(). Only with WITH_TXIRQ (see platf.h)
+ */
+void sci_txi(void);
+void sci_tei(void);
@@ -4,64 +4,234 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "stypes.h"
+#include "platf.h"
 
 //#define CRC16	0xC86C	//"baicheva00"
 #define CRC16	0xBAAD	//koopman, 2048bits (256B)
 //#define CRC16	0xa001	//common CRC16 (winhex)
 
-
 /*** CRC16 implementation adapted from Lammert Bies
  * https://www.lammertbies.nl/comm/info/crc-calculation.html
+ *
+ * crc_tab16[0][i] : crc of byte i, i.e. 8 rounds of "crc = (crc >> 1) ^ (lsb ? CRC16 : 0)" starting from i.
+ * With CRC16_SLICE4 (see platf.h), crc_tab16[k][i] : crc of byte i followed by k null bytes,
+ * i.e. crc_tab16[k][i] = (crc_tab16[k-1][i] >> 8) ^ crc_tab16[0][crc_tab16[k-1][i] & 0xFF]
+ * With CRC16_NIBBLE, crc_tab16n[i] : crc of half-byte i (4 rounds), i.e. crc_tab16[0][i << 4].
+ * Precomputed for CRC16 = 0xBAAD; regenerate them if it changes !
+ */
+#ifdef CRC16_NIBBLE
+static const u16 crc_tab16n[16] = {
+	0x0000, 0x64A8, 0xC950, 0xADF8, 0xE7FB, 0x8353, 0x2EAB, 0x4A03,
+	0xBAAD, 0xDE05, 0x73FD, 0x1755, 0x5D56, 0x39FE, 0x9406, 0xF0AE,
+};
+#else
+
+#ifdef CRC16_SLICE4
+	#define CRC16_NTABS	4
+#else
+	#define CRC16_NTABS	1
+#endif
+
+static const u16 crc_tab16[CRC16_NTABS][256] = {
+	{
+		0x0000, 0xBCE7, 0x0C95, 0xB072, 0x192A, 0xA5CD, 0x15BF, 0xA958,
+		0x3254, 0x8EB3, 0x3EC1, 0x8226, 0x2B7E, 0x9799, 0x27EB, 0x9B0C,
+		0x64A8, 0xD84F, 0x683D, 0xD4DA, 0x7D82, 0xC165, 0x7117, 0xCDF0,
+		0x56FC, 0xEA1B, 0x5A69, 0xE68E, 0x4FD6, 0xF331, 0x4343, 0xFFA4,
+		0xC950, 0x75B7, 0xC5C5, 0x7922, 0xD07A, 0x6C9D, 0xDCEF, 0x6008,
+		0xFB04, 0x47E3, 0xF791, 0x4B76, 0xE22E, 0x5EC9, 0xEEBB, 0x525C,
+		0xADF8, 0x111F, 0xA16D, 0x1D8A, 0xB4D2, 0x0835, 0xB847, 0x04A0,
+		0x9FAC, 0x234B, 0x9339, 0x2FDE, 0x8686, 0x3A61, 0x8A13, 0x36F4,
+		0xE7FB, 0x5B1C, 0xEB6E, 0x5789, 0xFED1, 0x4236, 0xF244, 0x4EA3,
+		0xD5AF, 0x6948, 0xD93A, 0x65DD, 0xCC85, 0x7062, 0xC010, 0x7CF7,
+		0x8353, 0x3FB4, 0x8FC6, 0x3321, 0x9A79, 0x269E, 0x96EC, 0x2A0B,
+		0xB107, 0x0DE0, 0xBD92, 0x0175, 0xA82D, 0x14CA, 0xA4B8, 0x185F,
+		0x2EAB, 0x924C, 0x223E, 0x9ED9, 0x3781, 0x8B66, 0x3B14, 0x87F3,
+		0x1CFF, 0xA018, 0x106A, 0xAC8D, 0x05D5, 0xB932, 0x0940, 0xB5A7,
+		0x4A03, 0xF6E4, 0x4696, 0xFA71, 0x5329, 0xEFCE, 0x5FBC, 0xE35B,
+		0x7857, 0xC4B0, 0x74C2, 0xC825, 0x617D, 0xDD9A, 0x6DE8, 0xD10F,
+		0xBAAD, 0x064A, 0xB638, 0x0ADF, 0xA387, 0x1F60, 0xAF12, 0x13F5,
+		0x88F9, 0x341E, 0x846C, 0x388B, 0x91D3, 0x2D34, 0x9D46, 0x21A1,
+		0xDE05, 0x62E2, 0xD290, 0x6E77, 0xC72F, 0x7BC8, 0xCBBA, 0x775D,
+		0xEC51, 0x50B6, 0xE0C4, 0x5C23, 0xF57B, 0x499C, 0xF9EE, 0x4509,
+		0x73FD, 0xCF1A, 0x7F68, 0xC38F, 0x6AD7, 0xD630, 0x6642, 0xDAA5,
+		0x41A9, 0xFD4E, 0x4D3C, 0xF1DB, 0x5883, 0xE464, 0x5416, 0xE8F1,
+		0x1755, 0xABB2, 0x1BC0, 0xA727, 0x0E7F, 0xB298, 0x02EA, 0xBE0D,
+		0x2501, 0x99E6, 0x2994, 0x9573, 0x3C2B, 0x80CC, 0x30BE, 0x8C59,
+		0x5D56, 0xE1B1, 0x51C3, 0xED24, 0x447C, 0xF89B, 0x48E9, 0xF40E,
+		0x6F02, 0xD3E5, 0x6397, 0xDF70, 0x7628, 0xCACF, 0x7ABD, 0xC65A,
+		0x39FE, 0x8519, 0x356B, 0x898C, 0x20D4, 0x9C33, 0x2C41, 0x90A6,
+		0x0BAA, 0xB74D, 0x073F, 0xBBD8, 0x1280, 0xAE67, 0x1E15, 0xA2F2,
+		0x9406, 0x28E1, 0x9893, 0x2474, 0x8D2C, 0x31CB, 0x81B9, 0x3D5E,
+		0xA652, 0x1AB5, 0xAAC7, 0x1620, 0xBF78, 0x039F, 0xB3ED, 0x0F0A,
+		0xF0AE, 0x4C49, 0xFC3B, 0x40DC, 0xE984, 0x5563, 0xE511, 0x59F6,
+		0xC2FA, 0x7E1D, 0xCE6F, 0x7288, 0xDBD0, 0x6737, 0xD745, 0x6BA2,
+	},
+#ifdef CRC16_SLICE4
+	{
+		0x0000, 0x3DE2, 0x7BC4, 0x4626, 0xF788, 0xCA6A, 0x8C4C, 0xB1AE,
+		0x9A4B, 0xA7A9, 0xE18F, 0xDC6D, 0x6DC3, 0x5021, 0x1607, 0x2BE5,
+		0x41CD, 0x7C2F, 0x3A09, 0x07EB, 0xB645, 0x8BA7, 0xCD81, 0xF063,
+		0xDB86, 0xE664, 0xA042, 0x9DA0, 0x2C0E, 0x11EC, 0x57CA, 0x6A28,
+		0x839A, 0xBE78, 0xF85E, 0xC5BC, 0x7412, 0x49F0, 0x0FD6, 0x3234,
+		0x19D1, 0x2433, 0x6215, 0x5FF7, 0xEE59, 0xD3BB, 0x959D, 0xA87F,
+		0xC257, 0xFFB5, 0xB993, 0x8471, 0x35DF, 0x083D, 0x4E1B, 0x73F9,
+		0x581C, 0x65FE, 0x23D8, 0x1E3A, 0xAF94, 0x9276, 0xD450, 0xE9B2,
+		0x726F, 0x4F8D, 0x09AB, 0x3449, 0x85E7, 0xB805, 0xFE23, 0xC3C1,
+		0xE824, 0xD5C6, 0x93E0, 0xAE02, 0x1FAC, 0x224E, 0x6468, 0x598A,
+		0x33A2, 0x0E40, 0x4866, 0x7584, 0xC42A, 0xF9C8, 0xBFEE, 0x820C,
+		0xA9E9, 0x940B, 0xD22D, 0xEFCF, 0x5E61, 0x6383, 0x25A5, 0x1847,
+		0xF1F5, 0xCC17, 0x8A31, 0xB7D3, 0x067D, 0x3B9F, 0x7DB9, 0x405B,
+		0x6BBE, 0x565C, 0x107A, 0x2D98, 0x9C36, 0xA1D4, 0xE7F2, 0xDA10,
+		0xB038, 0x8DDA, 0xCBFC, 0xF61E, 0x47B0, 0x7A52, 0x3C74, 0x0196,
+		0x2A73, 0x1791, 0x51B7, 0x6C55, 0xDDFB, 0xE019, 0xA63F, 0x9BDD,
+		0xE4DE, 0xD93C, 0x9F1A, 0xA2F8, 0x1356, 0x2EB4, 0x6892, 0x5570,
+		0x7E95, 0x4377, 0x0551, 0x38B3, 0x891D, 0xB4FF, 0xF2D9, 0xCF3B,
+		0xA513, 0x98F1, 0xDED7, 0xE335, 0x529B, 0x6F79, 0x295F, 0x14BD,
+		0x3F58, 0x02BA, 0x449C, 0x797E, 0xC8D0, 0xF532, 0xB314, 0x8EF6,
+		0x6744, 0x5AA6, 0x1C80, 0x2162, 0x90CC, 0xAD2E, 0xEB08, 0xD6EA,
+		0xFD0F, 0xC0ED, 0x86CB, 0xBB29, 0x0A87, 0x3765, 0x7143, 0x4CA1,
+		0x2689, 0x1B6B, 0x5D4D, 0x60AF, 0xD101, 0xECE3, 0xAAC5, 0x9727,
+		0xBCC2, 0x8120, 0xC706, 0xFAE4, 0x4B4A, 0x76A8, 0x308E, 0x0D6C,
+		0x96B1, 0xAB53, 0xED75, 0xD097, 0x6139, 0x5CDB, 0x1AFD, 0x271F,
+		0x0CFA, 0x3118, 0x773E, 0x4ADC, 0xFB72, 0xC690, 0x80B6, 0xBD54,
+		0xD77C, 0xEA9E, 0xACB8, 0x915A, 0x20F4, 0x1D16, 0x5B30, 0x66D2,
+		0x4D37, 0x70D5, 0x36F3, 0x0B11, 0xBABF, 0x875D, 0xC17B, 0xFC99,
+		0x152B, 0x28C9, 0x6EEF, 0x530D, 0xE2A3, 0xDF41, 0x9967, 0xA485,
+		0x8F60, 0xB282, 0xF4A4, 0xC946, 0x78E8, 0x450A, 0x032C, 0x3ECE,
+		0x54E6, 0x6904, 0x2F22, 0x12C0, 0xA36E, 0x9E8C, 0xD8AA, 0xE548,
+		0xCEAD, 0xF34F, 0xB569, 0x888B, 0x3925, 0x04C7, 0x42E1, 0x7F03,
+	},
+	{
+		0x0000, 0x98AE, 0x4407, 0xDCA9, 0x880E, 0x10A0, 0xCC09, 0x54A7,
+		0x6547, 0xFDE9, 0x2140, 0xB9EE, 0xED49, 0x75E7, 0xA94E, 0x31E0,
+		0xCA8E, 0x5220, 0x8E89, 0x1627, 0x4280, 0xDA2E, 0x0687, 0x9E29,
+		0xAFC9, 0x3767, 0xEBCE, 0x7360, 0x27C7, 0xBF69, 0x63C0, 0xFB6E,
+		0xE047, 0x78E9, 0xA440, 0x3CEE, 0x6849, 0xF0E7, 0x2C4E, 0xB4E0,
+		0x8500, 0x1DAE, 0xC107, 0x59A9, 0x0D0E, 0x95A0, 0x4909, 0xD1A7,
+		0x2AC9, 0xB267, 0x6ECE, 0xF660, 0xA2C7, 0x3A69, 0xE6C0, 0x7E6E,
+		0x4F8E, 0xD720, 0x0B89, 0x9327, 0xC780, 0x5F2E, 0x8387, 0x1B29,
+		0xB5D5, 0x2D7B, 0xF1D2, 0x697C, 0x3DDB, 0xA575, 0x79DC, 0xE172,
+		0xD092, 0x483C, 0x9495, 0x0C3B, 0x589C, 0xC032, 0x1C9B, 0x8435,
+		0x7F5B, 0xE7F5, 0x3B5C, 0xA3F2, 0xF755, 0x6FFB, 0xB352, 0x2BFC,
+		0x1A1C, 0x82B2, 0x5E1B, 0xC6B5, 0x9212, 0x0ABC, 0xD615, 0x4EBB,
+		0x5592, 0xCD3C, 0x1195, 0x893B, 0xDD9C, 0x4532, 0x999B, 0x0135,
+		0x30D5, 0xA87B, 0x74D2, 0xEC7C, 0xB8DB, 0x2075, 0xFCDC, 0x6472,
+		0x9F1C, 0x07B2, 0xDB1B, 0x43B5, 0x1712, 0x8FBC, 0x5315, 0xCBBB,
+		0xFA5B, 0x62F5, 0xBE5C, 0x26F2, 0x7255, 0xEAFB, 0x3652, 0xAEFC,
+		0x1EF1, 0x865F, 0x5AF6, 0xC258, 0x96FF, 0x0E51, 0xD2F8, 0x4A56,
+		0x7BB6, 0xE318, 0x3FB1, 0xA71F, 0xF3B8, 0x6B16, 0xB7BF, 0x2F11,
+		0xD47F, 0x4CD1, 0x9078, 0x08D6, 0x5C71, 0xC4DF, 0x1876, 0x80D8,
+		0xB138, 0x2996, 0xF53F, 0x6D91, 0x3936, 0xA198, 0x7D31, 0xE59F,
+		0xFEB6, 0x6618, 0xBAB1, 0x221F, 0x76B8, 0xEE16, 0x32BF, 0xAA11,
+		0x9BF1, 0x035F, 0xDFF6, 0x4758, 0x13FF, 0x8B51, 0x57F8, 0xCF56,
+		0x3438, 0xAC96, 0x703F, 0xE891, 0xBC36, 0x2498, 0xF831, 0x609F,
+		0x517F, 0xC9D1, 0x1578, 0x8DD6, 0xD971, 0x41DF, 0x9D76, 0x05D8,
+		0xAB24, 0x338A, 0xEF23, 0x778D, 0x232A, 0xBB84, 0x672D, 0xFF83,
+		0xCE63, 0x56CD, 0x8A64, 0x12CA, 0x466D, 0xDEC3, 0x026A, 0x9AC4,
+		0x61AA, 0xF904, 0x25AD, 0xBD03, 0xE9A4, 0x710A, 0xADA3, 0x350D,
+		0x04ED, 0x9C43, 0x40EA, 0xD844, 0x8CE3, 0x144D, 0xC8E4, 0x504A,
+		0x4B63, 0xD3CD, 0x0F64, 0x97CA, 0xC36D, 0x5BC3, 0x876A, 0x1FC4,
+		0x2E24, 0xB68A, 0x6A23, 0xF28D, 0xA62A, 0x3E84, 0xE22D, 0x7A83,
+		0x81ED, 0x1943, 0xC5EA, 0x5D44, 0x09E3, 0x914D, 0x4DE4, 0xD54A,
+		0xE4AA, 0x7C04, 0xA0AD, 0x3803, 0x6CA4, 0xF40A, 0x28A3, 0xB00D,
+	},
+	{
+		0x0000, 0x548E, 0xA91C, 0xFD92, 0x2763, 0x73ED, 0x8E7F, 0xDAF1,
+		0x4EC6, 0x1A48, 0xE7DA, 0xB354, 0x69A5, 0x3D2B, 0xC0B9, 0x9437,
+		0x9D8C, 0xC902, 0x3490, 0x601E, 0xBAEF, 0xEE61, 0x13F3, 0x477D,
+		0xD34A, 0x87C4, 0x7A56, 0x2ED8, 0xF429, 0xA0A7, 0x5D35, 0x09BB,
+		0x4E43, 0x1ACD, 0xE75F, 0xB3D1, 0x6920, 0x3DAE, 0xC03C, 0x94B2,
+		0x0085, 0x540B, 0xA999, 0xFD17, 0x27E6, 0x7368, 0x8EFA, 0xDA74,
+		0xD3CF, 0x8741, 0x7AD3, 0x2E5D, 0xF4AC, 0xA022, 0x5DB0, 0x093E,
+		0x9D09, 0xC987, 0x3415, 0x609B, 0xBA6A, 0xEEE4, 0x1376, 0x47F8,
+		0x9C86, 0xC808, 0x359A, 0x6114, 0xBBE5, 0xEF6B, 0x12F9, 0x4677,
+		0xD240, 0x86CE, 0x7B5C, 0x2FD2, 0xF523, 0xA1AD, 0x5C3F, 0x08B1,
+		0x010A, 0x5584, 0xA816, 0xFC98, 0x2669, 0x72E7, 0x8F75, 0xDBFB,
+		0x4FCC, 0x1B42, 0xE6D0, 0xB25E, 0x68AF, 0x3C21, 0xC1B3, 0x953D,
+		0xD2C5, 0x864B, 0x7BD9, 0x2F57, 0xF5A6, 0xA128, 0x5CBA, 0x0834,
+		0x9C03, 0xC88D, 0x351F, 0x6191, 0xBB60, 0xEFEE, 0x127C, 0x46F2,
+		0x4F49, 0x1BC7, 0xE655, 0xB2DB, 0x682A, 0x3CA4, 0xC136, 0x95B8,
+		0x018F, 0x5501, 0xA893, 0xFC1D, 0x26EC, 0x7262, 0x8FF0, 0xDB7E,
+		0x4C57, 0x18D9, 0xE54B, 0xB1C5, 0x6B34, 0x3FBA, 0xC228, 0x96A6,
+		0x0291, 0x561F, 0xAB8D, 0xFF03, 0x25F2, 0x717C, 0x8CEE, 0xD860,
+		0xD1DB, 0x8555, 0x78C7, 0x2C49, 0xF6B8, 0xA236, 0x5FA4, 0x0B2A,
+		0x9F1D, 0xCB93, 0x3601, 0x628F, 0xB87E, 0xECF0, 0x1162, 0x45EC,
+		0x0214, 0x569A, 0xAB08, 0xFF86, 0x2577, 0x71F9, 0x8C6B, 0xD8E5,
+		0x4CD2, 0x185C, 0xE5CE, 0xB140, 0x6BB1, 0x3F3F, 0xC2AD, 0x9623,
+		0x9F98, 0xCB16, 0x3684, 0x620A, 0xB8FB, 0xEC75, 0x11E7, 0x4569,
+		0xD15E, 0x85D0, 0x7842, 0x2CCC, 0xF63D, 0xA2B3, 0x5F21, 0x0BAF,
+		0xD0D1, 0x845F, 0x79CD, 0x2D43, 0xF7B2, 0xA33C, 0x5EAE, 0x0A20,
+		0x9E17, 0xCA99, 0x370B, 0x6385, 0xB974, 0xEDFA, 0x1068, 0x44E6,
+		0x4D5D, 0x19D3, 0xE441, 0xB0CF, 0x6A3E, 0x3EB0, 0xC322, 0x97AC,
+		0x039B, 0x5715, 0xAA87, 0xFE09, 0x24F8, 0x7076, 0x8DE4, 0xD96A,
+		0x9E92, 0xCA1C, 0x378E, 0x6300, 0xB9F1, 0xED7F, 0x10ED, 0x4463,
+		0xD054, 0x84DA, 0x7948, 0x2DC6, 0xF737, 0xA3B9, 0x5E2B, 0x0AA5,
+		0x031E, 0x5790, 0xAA02, 0xFE8C, 0x247D, 0x70F3, 0x8D61, 0xD9EF,
+		0x4DD8, 0x1956, 0xE4C4, 0xB04A, 0x6ABB, 0x3E35, 0xC3A7, 0x9729,
+	},
+#endif
+};
+#endif	//CRC16_NIBBLE
+
+
+/* bytewise : 12 cy/byte; tablesiz = 512B of .rodata.
+ * Slice-by-4 : one u32 load + 4 lookups per 4 bytes, for another 1.5kB of tables.
+ * Half-byte : 2 lookups per byte, like crc32(); 32B of table.
  */
-static bool crc_tab16_init = 0;
-static u16 crc_tab16[256];
-
-static void init_crc16_tab( void ) {
-	u32 i, j;
-	u16 crc, c;
-
-	for (i=0; i<256; i++) {
-		crc = 0;
-		c   = (u16) i;
-
-		for (j=0; j<8; j++) {
-			if ( (crc ^ c) & 0x0001 ) crc = ( crc >> 1 ) ^ CRC16;
-			else                      crc =   crc >> 1;
-			c = c >> 1;
-		}
-		crc_tab16[i] = crc;
-	}
-
-	crc_tab16_init = 1;
-
-}  /* init_crc16_tab */
-
-
-/* 12 cy/byte; codesize = 0x78; tablesiz = 512B */
 u16 crc16(const u8 *data, u32 siz) {
 	u16 crc;
 
-	if ( ! crc_tab16_init ) init_crc16_tab();
-
 	crc = 0;
 
-	while (siz > 0) {
-		u16 tmp;
-		u8 nextval;
-
-		nextval = *data++;
-		tmp =  crc       ^ nextval;
-		crc = (crc >> 8) ^ crc_tab16[ tmp & 0xff ];
-	#if 0
-		// not worth it : a lot more code, and only 0.5cy/B savings
-		nextval = *data++;
-		tmp =  crc       ^ nextval;
-		crc = (crc >> 8) ^ crc_tab16[ tmp & 0xff ];
-		siz -= 2;
-	#else
-		siz -= 1;
-	#endif
+#ifdef CRC16_SLICE4
+	/* bytewise up to the first u32 boundary */
+	for (; siz && ((u32) data & 3); siz--) {
+		crc = (crc >> 8) ^ crc_tab16[0][(crc ^ *data++) & 0xFF];
+	}
+
+	for (; siz >= 4; siz -= 4) {
+		/* big-endian : first byte is the MSB */
+		u32 w = *(const u32 *) data;
+		u16 x = crc ^ (w >> 24) ^ ((w >> 8) & 0xFF00);
+
+		data += 4;
+		crc = crc_tab16[3][x & 0xFF] ^ crc_tab16[2][x >> 8] ^
+			crc_tab16[1][(w >> 8) & 0xFF] ^ crc_tab16[0][w & 0xFF];
+	}
+#endif
+
+	for (; siz; siz--) {
+#ifdef CRC16_NIBBLE
+		crc ^= *data++;
+		crc = (crc >> 4) ^ crc_tab16n[crc & 0x0F];
+		crc = (crc >> 4) ^ crc_tab16n[crc & 0x0F];
+#else
+		crc = (crc >> 8) ^ crc_tab16[0][(crc ^ *data++) & 0xFF];
+#endif
 	}
 
 	return crc;
 }
+
+
+#ifdef WITH_CRCMAP
+/*** CRC32 (IEEE 802.3, as zlib's crc32()) : reflected 0x04C11DB7, init and final xor 0xFFFFFFFF.
+ * Half-byte table to keep it at 64B; for whole-block verification, where crc16 is too weak.
+ */
+static const u32 crc_tab32[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+u32 crc32(const u8 *data, u32 siz) {
+	u32 crc = 0xFFFFFFFF;
+
+	for (; siz; siz--) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ crc_tab32[crc & 0x0F];
+		crc = (crc >> 4) ^ crc_tab32[crc & 0x0F];
+	}
+	return ~crc;
+}
+#endif
@@ -5,4 +5,7 @@
 
 u16 crc16(const u8 *data, u32 siz);
 
+/** CRC32 as zlib crc32(). Only with WITH_CRCMAP (see platf.h) */
+u32 crc32(const u8 *data, u32 siz);
+
 #endif
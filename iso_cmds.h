@@ -19,12 +19,24 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Some commands are optional and depend on the WITH_xx defines in platf.h (SID_CONF_CAPS is one of them).
+ * A kernel built without one answers it with 7F ISO_NRC_SFNS_IF.
+ */
 
 #define SID_RECUID	0x1A	/* readECUID , in this case kernel ID */
 #define SID_RECUID_PRC	"\x5A"	/* positive response code, to be concatenated to version string */
 
 #define SID_RMBA 0x23	/* ReadMemByAddress. format : <SID_RMBA> <AH> <AM> <AL> <SIZ>  , siz <= 251. */
 				/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
+				/* scatter-gather format : <SID_RMBA> <N> N * (<AH> <AM> <AL> <SZ>) , i.e. even length.
+				 * SZ : RMBA_SG_Wxx access width | size (<= RMBA_SG_MAXSIZ, multiple of the width; address aligned to it).
+				 * response : <SID + 0x40> <D0>....<Dn> , data of every range in order, total <= RMBA_SG_MAXTOT */
+	#define RMBA_SG_W8	0x00	//byte access (memcpy)
+	#define RMBA_SG_W16	0x40	//16-bit accesses, for peripheral regs
+	#define RMBA_SG_W32	0x80	//32-bit accesses
+	#define RMBA_SG_WMASK	0xC0
+	#define RMBA_SG_MAXSIZ	0x3F
+	#define RMBA_SG_MAXTOT	254
 
 #define SID_WMBA 0x3D	/* WriteMemByAddress (RAM only !) . format : <SID_WMBA> <AH> <AM> <AL> <SIZ> <DATA> , siz <= 250. */
 				/* response : <SID + 0x40> <AH> <AM> <AL> */
@@ -34,6 +46,17 @@
 #define SID_DUMP 0xBD	/* format : 0xBD <AS> <BH BL> <AH AL>  ; AS=0 for EEPROM, =1 for ROM */
 	#define SID_DUMP_EEPROM	0
 	#define SID_DUMP_ROM 1
+	#define SID_DUMP_ROMSEG 2	/* segmented ROM dump, same args as SID_DUMP_ROM. Response is a first frame <SID + 0x40> <L2> <L1> <L0> (total # of bytes),
+				 * then consecutive frames <SID + 0x40> <SEQ> <D0>...<Dn-1>, n <= SID_DUMP_SEG_DLEN. SEQ starts at 0 and wraps at 0xFF */
+		#define SID_DUMP_SEG_DLEN	252
+	#define SID_DUMP_ROMRAW 3	/* raw stream ROM dump, same args as SID_DUMP_ROM. Response is one frame <SID + 0x40> <L2> <L1> <L0> (total # of bytes),
+				 * followed by unframed data : every SID_DUMP_RAW_CHUNK bytes (or fewer for the last chunk) are followed by <CRCH> <CRCL>,
+				 * the crc16() of that chunk (same CRC as SID_CONF_CKS1). Corrupt chunks can be re-read with a normal SID_DUMP. */
+		#define SID_DUMP_RAW_CHUNK	256
+	#define SID_DUMP_ROMLZ 4	/* compressed ROM dump, same args as SID_DUMP_ROM. Response frames are <SID + 0x40> <SLH> <SLL> <C0>...<Cn-1>, n <= SID_DUMP_LZ_DLEN :
+				 * <SLH SLL> bytes of ROM compressed as per lz.h. Each frame decodes by itself and continues where the previous one ended;
+				 * after an error, re-request from the end of the last good frame. */
+		#define SID_DUMP_LZ_DLEN	252
 
 /* SID_FLASH and subcommands */
 #define SID_FLASH 0xBC	/* low-level reflash commands; only available after successful RequestDownload */
@@ -42,6 +65,72 @@
 	#define SIDFL_WB	0x02	//write n-byte block. format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D(SIDFL_WB_DLEN -1)> <CRC>
 						// Address is <A2 A1 A0>;   CRC is calculated on address + data.
 	#define SIDFL_WB_DLEN	128	//bytes sent per niprog block
+	#define SIDFL_WBP	0x03	//pipelined write. Same format as SIDFL_WB, but the response is sent before programming,
+						// and reports the status of the *previous* SIDFL_WBP block (7F NRC if it failed; the new block is then discarded).
+						// The RX ring buffer holds the next frame while this one is programmed.
+						// <SID_FLASH> <SIDFL_WBP> alone only fetches (and clears) the pending status; send this after the last block.
+	#define SIDFL_WBL	0x04	//streamed write, up to SIDFL_WBL_MAXDLEN bytes per frame. format : <SID_FLASH> <SIDFL_WBL> <A2> <A1> <A0> <D0>...<Dn-1> <CRC>
+						// Every completed SIDFL_WB_DLEN page is programmed; a partial page is kept until the next frame,
+						// which must continue at <A2 A1 A0> + n. The first frame must start on a page boundary, and the stream must end on one.
+						// CRC as for SIDFL_WB. <SID_FLASH> <SIDFL_WBL> alone returns <SID_FLASH + 0x40> <SIDFL_WBL_MAXDLEN> <# of bytes not yet programmed>
+	#define SIDFL_WBL_MAXDLEN	(255 - 6)
+	#define SIDFL_SEGW	0x05	//segmented write, first frame. format : <SID_FLASH> <SIDFL_SEGW> <A2> <A1> <A0> <L2> <L1> <L0>
+						// Declares <L2 L1 L0> bytes (multiple of SIDFL_WB_DLEN) to be written at page-aligned <A2 A1 A0>, then
+						// sent in SIDFL_SEGC frames. Response is immediate.
+						// <SID_FLASH> <SIDFL_SEGW> alone returns the transfer status and ends it :
+						// <SID_FLASH + 0x40> <NRC or 0> <A2> <A1> <A0> ; A = first address not yet programmed, to resume from
+						// (after a flash error NRC, the block needs to be erased again anyway).
+	#define SIDFL_SEGC	0x06	//segmented write, consecutive frame. format : <SID_FLASH> <SIDFL_SEGC> <SEQ> <D0>...<Dn-1> <CRC>
+						// SEQ starts at 0 after SIDFL_SEGW and wraps at 0xFF. CRC as for SIDFL_WB, calculated on SEQ + data.
+						// There is no response, except a single positive response after the last byte is programmed.
+						// If a frame is lost or fails, the following frames are ignored : use the SIDFL_SEGW status query.
+	#define SIDFL_WBW	0x07	//windowed write. format : <SID_FLASH> <SIDFL_WBW> <SEQ> <A2> <A1> <A0> <D0>...<D127> <CRC>
+						// CRC as for SIDFL_WB, calculated on SEQ + address + data. SEQ starts at 0 after RequestDownload.
+						// No response; up to SIDFL_WBW_WIN frames can be sent back-to-back, then poll with
+						// <SID_FLASH> <SIDFL_WBW> <NEXTSEQ> (SEQ of the next frame the host would send).
+						// Response : <SID_FLASH + 0x40> <ACK> [<SEQ> <NRC>]... ; every frame before ACK is programmed,
+						// and each listed frame must be re-sent. NRC is 0 if it was never received.
+		#define SIDFL_WBW_WIN	8
+	#define SIDFL_WBZ	0x08	//compressed write. format : <SID_FLASH> <SIDFL_WBZ> <A2> <A1> <A0> <NP> <CRCH> <CRCL> <C0>...<Cn-1> <CKS>
+						// <C0..Cn-1> decodes (see lz.h) to exactly NP * SIDFL_WB_DLEN bytes, NP <= SIDFL_WBZ_MAXPAGES, to be written at <A2 A1 A0>.
+						// <CRCH CRCL> is the crc16() of the decoded data, checked before writing. CKS as for SIDFL_WB, calculated on <A2>...<Cn-1>.
+		#define SIDFL_WBZ_MAXPAGES	4
+	#define SIDFL_DELTA	0x09	//rebuild an erase block in RAM from its current contents + a patch, then erase + write it.
+						// Only for blocks <= DELTA_BUFSIZE (see platf.h). Sub-functions, format : <SID_FLASH> <SIDFL_DELTA> <DELTA_xx> ...
+		#define DELTA_START	0x01	// <BLOCK #> : load current contents of the block
+		#define DELTA_DATA	0x02	// <OFSH> <OFSL> <D0>...<Dn-1> : replace n bytes at offset OFS in the block
+		#define DELTA_COPY	0x03	// <OFSH> <OFSL> <A2> <A1> <A0> <LENH> <LENL> : copy LEN bytes of current ROM at <A2 A1 A0> to offset OFS.
+							// A + LEN must be within ROMSIZE (PFWB_OOB otherwise).
+		#define DELTA_COMMIT	0x04	// <CRCH> <CRCL> : if the crc16() of the rebuilt block matches, erase and write it.
+	#define SIDFL_EBA	0x0A	//start erasing a block in the background : <SID_FLASH> <SIDFL_EBA> <BLOCK #>
+						// Response : <SID_FLASH + 0x40> <JOBID>. The erase runs while the kernel is waiting for RX data. Until it's done :
+						// - if built, SIDFL_WBL / SIDFL_SEGW / SIDFL_SEGC pages are kept in RAM (DELTA_BUFSIZE contiguous bytes, if no DELTA
+						//   or COPY data is loaded) and programmed once the erase succeeds; SIDFL_EBS reports if that fails. A frame that doesn't fit
+						//   gets ISO_NRC_BRR : SIDFL_WBL can re-send it later, a SIDFL_SEGC transfer stops and resumes as after any error.
+						// - DELTA_START, DELTA_DATA and DELTA_COPY work, except on the block being erased (ISO_NRC_BRR).
+						// - SID_CONF crc / CMP requests that read the block being erased get ISO_NRC_BRR.
+						// - every other SID_FLASH request, and SID_FLREQ, get 7F ISO_NRC_BRR.
+						// DELTA_COMMIT skips the erase if this job erased the same block and nothing was written to it since.
+						// Only on 350nm SH7055 and SH7051 kernels, which erase in short pulses (see WITH_EBA in platf.h).
+						// On 180nm parts (SH7055_18, SH7058) the erase microcode can't be interrupted, so nothing could overlap with it.
+	#define SIDFL_EBS	0x0B	//background erase status : <SID_FLASH> <SIDFL_EBS>
+						// Response : <SID_FLASH + 0x40> <JOBID> <STATE> <NRC> <STEPS>. NRC is what SIDFL_EB would have returned
+						// if STATE is EBS_FAILED, 0 otherwise. STEPS = # of erase pulses so far (saturates at 0xFF).
+						// Also valid before SID_FLREQ.
+		#define EBS_IDLE	0x00	// no job since the kernel started
+		#define EBS_RUNNING	0x01
+		#define EBS_DONE	0x02
+		#define EBS_FAILED	0x03
+	#define SIDFL_FILL	0x0C	//pattern fill. format : <SID_FLASH> <SIDFL_FILL> <A2> <A1> <A0> <L2> <L1> <L0> <P0>...<Pn-1>
+						// Programs <L2 L1 L0> bytes (multiple of SIDFL_WB_DLEN) at page-aligned <A2 A1 A0> with P0...Pn-1 repeated,
+						// starting with P0 at A. 1 <= n <= SIDFL_FILL_MAXPAT. Pages that would be all 0xFF are left alone.
+		#define SIDFL_FILL_MAXPAT	16
+	#define SIDFL_COPY	0x0D	//copy ROM data to another address through a RAM buffer of DELTA_BUFSIZE bytes (see platf.h).
+						// Sub-functions, format : <SID_FLASH> <SIDFL_COPY> <COPY_xx> ...
+		#define COPY_LOAD	0x01	// <S2> <S1> <S0> <L2> <L1> <L0> : copy L bytes (multiple of SIDFL_WB_DLEN) of current ROM at S to RAM.
+							// Do this before erasing the block(s) that hold S.
+		#define COPY_WRITE	0x02	// <D2> <D1> <D0> : write the loaded data at page-aligned D. The data stays loaded until
+							// the next COPY_LOAD, SIDFL_WBZ, DELTA_START or SID_FLREQ.
 
 /* SID_CONF and subcommands */
 #define SID_CONF 0xBE /* set & configure kernel */
@@ -55,6 +144,72 @@
 	#define SID_CONF_R16 0x04		/* for debugging : do a 16bit access read at given adress in RAM (top byte 0xFF)
 									* <SID_CONF> <SID_CONF_R16> <A2> <A1> <A0> */
 	#define SID_CONF_LASTERR 0x05	// get last internal error code then clear to 0 (ERR_OK)
+	#define SID_CONF_CRCMAP 0x06	/* crc16() of every chunk in a range : <SID_CONF> <SID_CONF_CRCMAP> <A2> <A1> <A0> <L2> <L1> <L0> <CSZ>
+									* chunk size is (ROMCRC_CHUNKSIZE << CSZ), CSZ <= 4 (256B - 4kB); address and length must be multiples of it.
+									* Response : one or more <SID_CONF + 0x40> <CRC0H> <CRC0L>... , up to SID_CONF_CRCMAP_MAX crcs per frame */
+		#define SID_CONF_CRCMAP_MAX	126
+	#define SID_CONF_BLKCRC 0x07	/* crc16() of every erase block : <SID_CONF> <SID_CONF_BLKCRC>
+									* Response : <SID_CONF + 0x40> <# of blocks> <CRC0H> <CRC0L>... */
+	#define SID_CONF_CRC32 0x08	/* CRC32 (as zlib crc32()) of a range : <SID_CONF> <SID_CONF_CRC32> <A2> <A1> <A0> <L2> <L1> <L0>
+									* Response : <SID_CONF + 0x40> <C3> <C2> <C1> <C0> */
+	#define SID_CONF_CMP 0x09	/* compare memory with reference data streamed by the host, in SIDFL_WB_DLEN pages.
+									* Sub-functions, format : <SID_CONF> <SID_CONF_CMP> <CMP_xx> ... */
+		#define CMP_START	0x01	// <A2> <A1> <A0> : page-aligned start address. Positive response
+		#define CMP_DATA	0x02	// <O2> <O1> <O0> <D0>...<Dn-1> : reference data for start + O. No response
+		#define CMP_END	0x03	// response : <SID_CONF + 0x40> <L2> <L1> <L0> <B0>...<Bn-1> : L = # of bytes compared,
+							// bit (p & 7) of B(p / 8) set if page p (from start) differs. n covers the last page received.
+							// 7F if any data fell outside of SID_CONF_CMP_MAXPAGES.
+		#define SID_CONF_CMP_MAXPAGES	1024
+	#define SID_CONF_CAPS 0x0A	/* kernel capabilities and flash geometry : <SID_CONF> <SID_CONF_CAPS>
+									* Response : <SID_CONF + 0x40> <CAPS_VER> <FLAGS> <ROMSIZE2> <ROMSIZE1> <ROMSIZE0>
+									*	<WGRAN> (flash programming unit) <SIDFL_WB_DLEN>
+									*	<RAM_MIN (4 bytes)> <RAM_MAX (4 bytes)>
+									*	<RXBUFH> <RXBUFL> <SIDFL_WBL_MAXDLEN> <SIDFL_WBW_WIN> <SIDFL_WBZ_MAXPAGES>
+									*	<DELTA_BUFSIZE (2 bytes)> <SID_CONF_CMP_MAXPAGES (2 bytes)> <SID_CONF_CRCMAP_MAX>
+									*	<NSID> <SID0>...<SIDn-1>
+									*	<NBLK> NBLK * (<B2> <B1> <B0>) : start of every erase block; the last one ends at ROMSIZE
+									* All multi-byte values are big-endian. The size of a command that isn't built in is 0. */
+		#define CAPS_VER	1
+		#define CAPS_F_SSM	0x01	//Subaru kernel
+		#define CAPS_F_CRCCACHE	0x02	//SID_CONF_CKS1 and 256B SID_CONF_CRCMAP are served from a ROM crc cache
+		#define CAPS_F_R16	0x04	//SID_CONF_R16 available
+		#define CAPS_F_EVERIFY	0x08	//blocks are blank-checked after erase
+	#define SID_CONF_SPEEDNEG 0x0B	/* negotiate comm speed : <SID_CONF> <SID_CONF_SPEEDNEG> <DIV0>...<DIVn-1> , n <= SPEEDNEG_MAXCAND, fastest first.
+									* For every candidate, until one passes :
+									* - kernel sends <SID_CONF + 0x40> <DIV> at the current speed, then switches to DIV;
+									* - host switches, and sends the SPEEDNEG_PATTERN bytes (raw, no framing) within SPEEDNEG_TMO ms;
+									* - kernel sends <SID_CONF + 0x40> <DIV> <BITERR> at the new speed (missing bytes count as 8 errors);
+									* - if BITERR == 0, host sends <SID_CONF> <SID_CONF_SPEEDNEG> within SPEEDNEG_TMO ms :
+									*	kernel commits and sends <SID_CONF + 0x40>.
+									* Otherwise, both go back to the original speed; the kernel waits until the line is idle for SPEEDNEG_GAP ms
+									* before trying the next candidate. If none pass, 7F at the original speed. Unlike SID_CONF_SETSPEED,
+									* this doesn't reset the session. */
+		#define SPEEDNEG_MAXCAND	8
+		#define SPEEDNEG_TMO	100
+		#define SPEEDNEG_GAP	50
+		#define SPEEDNEG_PLEN	16
+		#define SPEEDNEG_PATTERN	{ 0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC, \
+									0x01, 0x80, 0x7F, 0xFE, 0x5A, 0xA5, 0x96, 0x69 }
+	#define SID_CONF_JOURNAL 0x0C	/* reflash journal since the last SID_FLREQ, to resume after a link drop. Pages are SIDFL_WB_DLEN bytes.
+									* Only real erases / writes are recorded, i.e. none before SIDFL_UNPROTECT.
+									* <SID_CONF> <SID_CONF_JOURNAL> <PH> <PL> : PH:PL multiple of 8.
+									*	Response : <SID_CONF + 0x40> <E3> <E2> <E1> <E0> <B0>...<Bn-1> , n <= JOURNAL_MAPMAX :
+									*	bit b of E set if block b was erased; bit (p & 7) of B(p / 8) set if page (PH:PL + p) was programmed and verified.
+									*	Erasing a block clears its pages.
+									* <SID_CONF> <SID_CONF_JOURNAL> <PH> <PL> <N> : crc16() of N <= JOURNAL_CRCMAX pages from PH:PL, as currently in flash
+									*	Response : <SID_CONF + 0x40> <CRC0H> <CRC0L>... */
+		#define JOURNAL_MAPMAX	240
+		#define JOURNAL_CRCMAX	126
+	#define SID_CONF_PROGRESS 0x0D	/* progress frames during block erases (SIDFL_EB, DELTA_COMMIT) : <SID_CONF> <SID_CONF_PROGRESS> <INTV>
+									* While erasing, every INTV * 10 ms the kernel sends <SID_CONF + 0x40> <SID_CONF_PROGRESS> <BLOCK #> <PULSES>
+									* before the final response; PULSES saturates at 0xFF. INTV = 0 (default) disables. Not sent within SID_BATCH.
+									* Only on 350nm SH7055 and SH7051 kernels (see WITH_PROGRESS in platf.h) : on 180nm parts
+									* the erase microcode can't be interrupted, so the kernel couldn't send anything. */
+
+#define SID_BATCH 0xBB	/* run several requests in order. format : <SID_BATCH> (<LEN> <SID> <args>...)... ; LEN = 1 + # of args */
+				/* Stops after the first negative response. SID_DUMP, SID_RESET, SID_BATCH, SID_CONF_SETSPEED and SID_CONF_SPEEDNEG are refused (7F).
+				 * response : <SID + 0x40> <N> (<RLEN> <RSID> <...>)... ; N = # of requests run, followed by every response frame they produced.
+				 * Requests without a response add no entry; entries that would overflow the frame are dropped. */
 
 #define SID_FLREQ 0x34	/* RequestDownload */
 #define SID_STARTCOMM 0x81 /* startCommunication */
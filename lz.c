@@ -0,0 +1,125 @@
+/* LZ77 / RLE codec for compressed ROM dumps and flash payloads; see lz.h for the format */
+
+/* (c) copyright fenugrec 2016
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>	//memcpy, memset
+
+#include "stypes.h"
+#include "lz.h"
+
+/* The source is memory-mapped ROM, so there is no need for a window buffer :
+ * candidates are found with a small hash table of the last position (+1, 0 = empty)
+ * where each 3-byte prefix was seen. 512B of RAM.
+ */
+#define LZ_HASHSIZE	256
+#define LZ_HASH(p)	((((p)[0] << 5) ^ ((p)[1] << 2) ^ (p)[2]) & (LZ_HASHSIZE - 1))
+
+static u16 lz_hashtab[LZ_HASHSIZE];
+
+
+/** write pending literal run ending at src, return new output index */
+static unsigned lz_flushlit(u8 *dst, unsigned out, const u8 *src, unsigned nlit) {
+	if (!nlit) return out;
+	dst[out++] = nlit - 1;
+	memcpy(&dst[out], src - nlit, nlit);
+	return out + nlit;
+}
+
+unsigned lz_encode(const u8 *src, unsigned srclen, u8 *dst, unsigned dstmax, unsigned *consumed) {
+	unsigned pos = 0;
+	unsigned nlit = 0;	//pending literals, ending at src[pos]
+	unsigned out = 0;
+
+	if (srclen > LZ_MAXSRC) srclen = LZ_MAXSRC;
+	memset(lz_hashtab, 0, sizeof(lz_hashtab));
+
+	while (pos < srclen) {
+		unsigned mlen = 0;
+		unsigned moff = 0;
+
+		if ((srclen - pos) >= LZ_MINMATCH) {
+			unsigned h = LZ_HASH(&src[pos]);
+			unsigned cand = lz_hashtab[h];
+
+			lz_hashtab[h] = pos + 1;
+			if (cand && ((pos - (cand - 1)) <= LZ_MAXOFS)) {
+				const u8 *m = &src[cand - 1];
+				unsigned maxlen = srclen - pos;
+
+				if (maxlen > LZ_MAXMATCH) maxlen = LZ_MAXMATCH;
+				while ((mlen < maxlen) && (m[mlen] == src[pos + mlen])) {
+					mlen++;
+				}
+				moff = pos - (cand - 1);
+			}
+		}
+
+		if (mlen >= LZ_MINMATCH) {
+			//room for pending literals + match token ?
+			if ((out + 2 + (nlit ? (nlit + 1) : 0)) > dstmax) break;
+			out = lz_flushlit(dst, out, &src[pos], nlit);
+			nlit = 0;
+			dst[out++] = 0x80 | (mlen - LZ_MINMATCH);
+			dst[out++] = moff - 1;
+			pos += mlen;
+			continue;
+		}
+
+		//room for this literal + its control byte ?
+		if ((out + 1 + nlit + 1) > dstmax) break;
+		nlit++;
+		pos++;
+		if (nlit == LZ_MAXLIT) {
+			out = lz_flushlit(dst, out, &src[pos], nlit);
+			nlit = 0;
+		}
+	}
+
+	out = lz_flushlit(dst, out, &src[pos], nlit);
+	*consumed = pos;
+	return out;
+}
+
+int lz_decode(const u8 *src, unsigned srclen, u8 *dst, unsigned dstmax) {
+	unsigned in = 0;
+	unsigned out = 0;
+
+	while (in < srclen) {
+		unsigned c = src[in++];
+		unsigned len;
+
+		if (c < 0x80) {
+			len = c + 1;
+			if ((len > (srclen - in)) || (len > (dstmax - out))) return -1;
+			memcpy(&dst[out], &src[in], len);
+			in += len;
+			out += len;
+			continue;
+		}
+
+		unsigned ofs;
+		if (in == srclen) return -1;
+		ofs = src[in++] + 1;
+		len = (c & 0x7F) + LZ_MINMATCH;
+		if ((ofs > out) || (len > (dstmax - out))) return -1;
+		for (; len; len--, out++) {
+			dst[out] = dst[out - ofs];
+		}
+	}
+	return out;
+}
@@ -0,0 +1,36 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include "stypes.h"
+
+/* Byte-oriented LZ77 / RLE, used by SID_DUMP_ROMLZ and SIDFL_WBZ.
+ *
+ * Stream of tokens; each starts with a control byte c :
+ * - c < 0x80 : literal run, (c + 1) bytes follow.
+ * - c >= 0x80 : match, <OFS> follows. Copy ((c & 0x7F) + LZ_MINMATCH) bytes
+ *	starting (OFS + 1) bytes back in the decoded output. Byte-by-byte, so that
+ *	overlapping copies (OFS=0 : run of one byte) work.
+ */
+#define LZ_MINMATCH	3
+#define LZ_MAXMATCH	(0x7F + LZ_MINMATCH)
+#define LZ_MAXLIT	0x80
+#define LZ_MAXOFS	0x100
+#define LZ_MAXSRC	0x8000	//max srclen for one call
+
+/** compress as much of src as will fit in dst.
+ * Matches only refer to data from the same call, so every output block is decodable by itself.
+ *
+ * @param srclen : <= LZ_MAXSRC
+ * @param dstmax : must be >= 2
+ * @param consumed : # of src bytes encoded, always > 0 if srclen > 0
+ * @return # of bytes written to dst
+ */
+unsigned lz_encode(const u8 *src, unsigned srclen, u8 *dst, unsigned dstmax, unsigned *consumed);
+
+/** decode a complete stream.
+ *
+ * @return # of bytes written to dst, or -1 if the stream is malformed or would overflow dstmax
+ */
+int lz_decode(const u8 *src, unsigned srclen, u8 *dst, unsigned dstmax);
+
+#endif
@@ -24,6 +24,7 @@
 #include "mfg.h"
 #include "platf.h"
 #include "cmd_parser.h"
+#include "romcrc.h"
    
 
 void main(void) {
@@ -31,6 +32,7 @@ void main(void) {
 
 	init_mfg();
 	init_platf();
+	romcrc_init();
 
 	/* and lower prio mask to let WDT run */
 	set_imask(0x07);
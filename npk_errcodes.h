@@ -33,6 +33,7 @@ void set_lasterr(u8 err);	//see SID_CONF_LASTERR
 #define ISO_NRC_GR	0x10	/* generalReject */
 #define ISO_NRC_SNS	0x11	/* serviceNotSupported */
 #define ISO_NRC_SFNS_IF	0x12	/* subFunctionNotSupported-Invalid Format */
+#define ISO_NRC_BRR	0x21	/* busyRepeatRequest */
 #define ISO_NRC_CNCORSE	0x22	/* conditionsNoteCorrectOrRequestSequenceError */
 #define ISO_NRC_IK	0x35	/* invalidKey */
 #define ISO_NRC_CNDTSA	0x42	/* canNotDownloadToSpecifiedAddress */
@@ -63,6 +64,7 @@ void set_lasterr(u8 err);	//see SID_CONF_LASTERR
 
 #define PFEB_BADBLOCK 0x8C	//erase: bad block #
 #define PFEB_VERIFAIL 0x8D	//erase verify failed
+#define PFEB_BUSY 0x100	//platf_flash_eb_step() : erase not done yet. Never sent, deliberately outside the u8 NRC range
 
 #define PF_SILICON 0x8E	//Not running on correct silicon (180 / 350nm)
 
@@ -65,6 +65,7 @@ sh-elf-size with write + erase C implems: 4292	1024	548 => 5864, delta = 912B
 #include "platf.h"
 #include "iso_cmds.h"
 #include "npk_errcodes.h"
+#include "romcrc.h"
 
 enum internal_errcodes {
 	ERR_OK = 0,
@@ -177,6 +178,10 @@ const u32 fblocks[] = {
 	0x00080000		//last one just for delimiting the last block
 };
 
+const unsigned fl_nblocks = BLK_MAX;
+const unsigned fl_wgran = 128;
+const bool fl_everify = 1;	//erase loop runs until ferasevf() passes
+
 
 
 
@@ -289,11 +294,14 @@ static void ferase(unsigned blockno) {
 
 
 
-uint32_t platf_flash_eb(unsigned blockno) {
-	unsigned count;
+static unsigned eb_block;	//block being erased by platf_flash_eb_step()
+static unsigned eb_left;	//erase pulses left; 0 if no erase in progress
 
+uint32_t platf_flash_eb_start(unsigned blockno) {
 	if (blockno >= BLK_MAX) return PFEB_BADBLOCK;
+	eb_left = 0;
 	if (!reflash_enabled) return 0;
+	romcrc_inval(fblocks[blockno], fblocks[blockno + 1] - fblocks[blockno]);
 
 	if (fblocks[blockno] >= FLMCR2_BEGIN) {
 		pFLMCR = &FLASH.FLMCR2.BYTE;
@@ -320,18 +328,25 @@ uint32_t platf_flash_eb(unsigned blockno) {
 	}
 #endif
 
+	eb_block = blockno;
+	eb_left = MAX_ET;
+	return 0;
+}
 
-	for (count = 0; count < MAX_ET; count++) {
-		ferase(blockno);
-		if (ferasevf(blockno)) {
-			sweclear();
-			return 0;
-		}
+uint32_t platf_flash_eb_step(void) {
+	if (!eb_left) return 0;
+
+	ferase(eb_block);
+	if (ferasevf(eb_block)) {
+		eb_left = 0;
+		sweclear();
+		return 0;
 	}
+	if (--eb_left) return PFEB_BUSY;
+
 	/* haven't managed to get a succesful ferasevf() : badexit */
 	sweclear();
 	return PFEB_VERIFAIL;
-
 }
 
 
@@ -481,6 +496,7 @@ uint32_t platf_flash_wb(uint32_t dest, uint32_t src, uint32_t len) {
 	if (len & 0x7F) return PFWB_LEN;	//must be multiple of 128B too
 
 	if (!reflash_enabled) return 0;	//pretend success
+	romcrc_inval(dest, len);
 
 	while (len) {
 		uint32_t rv = 0;
@@ -551,3 +567,7 @@ void platf_flash_unprotect(void) {
 	reflash_enabled = 1;
 }
 
+bool platf_flash_unprotected(void) {
+	return reflash_enabled;
+}
+
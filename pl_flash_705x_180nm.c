@@ -28,6 +28,7 @@
 #include "platf.h"
 #include "iso_cmds.h"
 #include "npk_errcodes.h"
+#include "romcrc.h"
 
 /*********  Reflashing defines
  *
@@ -129,6 +130,14 @@
 #define FL_FPEFEQ	(40 * 100)
 #define FL_ERASEBLOCKS	15	//EB0...EB15; see DS
 
+const unsigned fl_nblocks = FL_ERASEBLOCKS + 1;
+const unsigned fl_wgran = 128;
+#ifdef POSTERASE_VERIFY
+const bool fl_everify = 1;
+#else
+const bool fl_everify = 0;
+#endif
+
 
 
 
@@ -298,23 +307,42 @@ void platf_flash_unprotect(void) {
 	reflash_enabled = 1;
 }
 
+bool platf_flash_unprotected(void) {
+	return reflash_enabled;
+}
 
-uint32_t platf_flash_eb(unsigned blockno) {
-	uint32_t FPFR;
 
+static unsigned eb_block;	//block to be erased by platf_flash_eb_step()
+static bool eb_pending;
+
+uint32_t platf_flash_eb_start(unsigned blockno) {
 	if (blockno > FL_ERASEBLOCKS) return PFEB_BADBLOCK;
+	eb_pending = 0;
 	if (!reflash_enabled) return 0;
+	romcrc_inval(fblocks[blockno], fblocks[blockno + 1] - fblocks[blockno]);
+
+	eb_block = blockno;
+	eb_pending = 1;
+	return 0;
+}
+
+/* the erase microcode runs to completion, so this is a single step */
+uint32_t platf_flash_eb_step(void) {
+	uint32_t FPFR;
+
+	if (!eb_pending) return 0;
+	eb_pending = 0;
 
 	FLASH.FKEY = 0x5A;
-	FPFR = fl_erase(blockno);
+	FPFR = fl_erase(eb_block);
 	if (FPFR) {
 		FLASH.FKEY = 0;
 		return ((FPFR & 0x06) | PF_FPFR_BASE);
 	}
 	FLASH.FKEY = 0;
 #ifdef POSTERASE_VERIFY
-	uint32_t vcur = fblocks[blockno];
-	uint32_t end = fblocks[blockno + 1];
+	uint32_t vcur = fblocks[eb_block];
+	uint32_t end = fblocks[eb_block + 1];
 	for (; vcur < end; vcur += 4) {
 		if (*(uint32_t *) vcur != 0xFFFFFFFF) return PFEB_VERIFAIL;
 	}
@@ -342,6 +370,8 @@ uint32_t platf_flash_wb(uint32_t dest, uint32_t src, uint32_t len) {
 	if (dest & 0x7F) return PFWB_MISALIGNED;	//dest not aligned on 128B boundary
 	if (len & 0x7F) return PFWB_LEN;	//must be multiple of 128B too
 
+	if (reflash_enabled) romcrc_inval(dest, len);
+
 	while (len) {
 		uint32_t rv = 0;
 
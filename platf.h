@@ -21,6 +21,66 @@
 /* Uncomment to taint WDT pulse for debug use */
 //#define DIAG_TAINTWDT
 
+/* crc16() slice-by-4 (see crc.c) : tables grow from 512B to 2kB of .rodata. Only where there's RAM to spare */
+#if defined(ssmk) && defined(SH7058)
+	#define CRC16_SLICE4
+#endif
+
+/* crc16() with a half-byte table : 32B instead of 512B, for about twice the cycles. Needed to fit SH7051 */
+#ifdef SH7051
+	#define CRC16_NIBBLE
+#endif
+
+/* iso_sendpkt() queues the frame in a 258B buffer sent by the SCI TXI / TEI interrupts.
+ * No room for that on SH7051 : it sends in a polled loop instead, like the reflash kernels always did.
+ */
+#ifndef SH7051
+	#define WITH_TXIRQ
+#endif
+
+/* Optional commands (see iso_cmds.h); the others answer 7F ISO_NRC_SFNS_IF.
+ * The kernel has to fit in the ldscripts/ regions : 6200B on SH7051 and 8kB on the other Nissan targets,
+ * .bss included; 8kB of code + data for ssm SH7055_18. Only ssm SH7058 has room for nearly everything.
+ *
+ * WITH_EBA and WITH_PROGRESS need an erase that runs as short pulses with interrupts enabled : 350nm SH7055
+ * and SH7051 only. On 180nm parts the erase microcode does the whole erase in one uninterruptible call, so a
+ * background job would just be a blocking erase that also lets the RX ring overflow, and no progress frame
+ * could be sent before the final response.
+ */
+#if defined(ssmk) && defined(SH7058)
+	#define WITH_CAPS	//SID_CONF_CAPS
+	#define WITH_FASTDUMP	//SID_DUMP_ROMSEG, SID_DUMP_ROMRAW
+	#define WITH_WBL	//SIDFL_WBL, SIDFL_SEGW, SIDFL_SEGC
+	#define WITH_WBW	//SIDFL_WBW
+	#define WITH_LZ	//SIDFL_WBZ, SID_DUMP_ROMLZ
+	#define WITH_DELTA	//SIDFL_DELTA, SIDFL_COPY (DELTA_BUFSIZE of .scratch)
+	#define WITH_FILL	//SIDFL_FILL
+	#define WITH_CRCMAP	//SID_CONF_CRCMAP, SID_CONF_BLKCRC, SID_CONF_CRC32
+	#define WITH_CMP	//SID_CONF_CMP
+	#define WITH_JOURNAL	//SID_CONF_JOURNAL
+	#define WITH_SPEEDNEG	//SID_CONF_SPEEDNEG
+	#define WITH_BATCH	//SID_BATCH
+	#define WITH_RMBA_SG	//scatter-gather SID_RMBA
+#elif defined(ssmk)
+	//.bss is outside the 8kB
+	#define WITH_CAPS
+	#define WITH_FASTDUMP
+	#define WITH_WBL
+#elif defined(SH7055_35)
+	#define WITH_CAPS
+	#define WITH_EBA	//SIDFL_EBA, SIDFL_EBS. With WITH_WBL, its pages would be staged in .scratch during the erase
+	#define WITH_PROGRESS	//SID_CONF_PROGRESS
+#elif defined(SH7051)
+	#define WITH_EBA
+	#define WITH_PROGRESS
+#else
+	#define WITH_CAPS
+#endif
+
+/* RAM staging buffer in the .scratch section : only erase blocks up to this size can be patched by SIDFL_DELTA,
+ * and up to this many bytes of SIDFL_WBL data are kept during a SIDFL_EBA job */
+#define DELTA_BUFSIZE	4096
+
 
 
 #include <stdbool.h>
@@ -28,6 +88,9 @@
 /****** mfg- and mcu-specific defines ******
 *
 * RAM_MIN, RAM_MAX : whole RAM area
+* NPK_SCI : SCI channel used for comms; NPK_SCI_IPR, IVTN_NPK_SCI_* : its interrupt priority field and vectors
+* ROMSIZE : size of internal flash
+* ROMCRC_CACHE_ADDR : optional; free RAM outside the kernel for the ROM CRC cache (see romcrc.h)
 * " #include "reg_defines/????" : i/o peripheral registers
 */
 
@@ -51,29 +114,56 @@
 		#include "reg_defines/7055_7058_180nm.h"
 		#define RAM_MIN	0xFFFF0000
 		#define RAM_MAX 	0xFFFFBFFF
+		#define ROMSIZE	(1024*1024UL)
 		#define RAMJUMP_PRELOAD_META 0xffff8000
 		#define NPK_SCI SCI1
+		#define NPK_SCI_IPR INTC.IPRK.BIT._SCI1
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI1_ERI1
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI1_RXI1
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI1_TXI1
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI1_TEI1
+		#define ROMCRC_CACHE_ADDR	0xFFFF3000	//between the flash microcodes and the kernel
 
 	#elif defined(SH7055_18)
 		#include "reg_defines/7055_7058_180nm.h"
 		#define RAM_MIN	0xFFFF6000
 		#define RAM_MAX	0xFFFFDFFF
+		#define ROMSIZE	(512*1024UL)
 		#define RAMJUMP_PRELOAD_META 0xffff8000
 		#define NPK_SCI SCI1
+		#define NPK_SCI_IPR INTC.IPRK.BIT._SCI1
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI1_ERI1
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI1_RXI1
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI1_TXI1
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI1_TEI1
+		#define ROMCRC_CACHE_ADDR	0xFFFFC000	//above the stack
 
 	#elif defined(SH7055_35)
 		#include "reg_defines/7055_350nm.h"
 		#define RAM_MIN	0xFFFF6000
 		#define RAM_MAX	0xFFFFDFFF
+		#define ROMSIZE	(512*1024UL)
 		#define RAMJUMP_PRELOAD_META 0xffff8000
 		#define NPK_SCI SCI1
+		#define NPK_SCI_IPR INTC.IPRK.BIT._SCI1
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI1_ERI1
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI1_RXI1
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI1_TXI1
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI1_TEI1
+		#define ROMCRC_CACHE_ADDR	0xFFFFC000	//above the stack
 
 	#elif defined(SH7051)
 		#include "reg_defines/7051.h"
 		#define RAM_MIN	0xFFFFD800
 		#define RAM_MAX	0xFFFFFFFF
+		#define ROMSIZE	(256*1024UL)
 		#define RAMJUMP_PRELOAD_META 0xffffD800
 		#define NPK_SCI SCI2
+		#define NPK_SCI_IPR INTC.IPRH.BIT._SCI2
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI2_ERI2
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI2_RXI2
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI2_TXI2
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI2_TEI2
 
 	#else
 		#error No target specified !
@@ -85,13 +175,27 @@
 		#include "reg_defines/7055_7058_180nm.h"
 		#define RAM_MIN	0xFFFF0000
 		#define RAM_MAX 	0xFFFFBFFF
+		#define ROMSIZE	(1024*1024UL)
 		#define NPK_SCI SCI2
+		#define NPK_SCI_IPR INTC.IPRK.BIT._SCI2
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI2_ERI2
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI2_RXI2
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI2_TXI2
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI2_TEI2
+		#define ROMCRC_CACHE_ADDR	0xFFFF9000	//above the stack
 
 	#elif defined(SH7055_18)
 		#include "reg_defines/7055_7058_180nm.h"
 		#define RAM_MIN	0xFFFF6000
 		#define RAM_MAX	0xFFFFDFFF
+		#define ROMSIZE	(512*1024UL)
 		#define NPK_SCI SCI2
+		#define NPK_SCI_IPR INTC.IPRK.BIT._SCI2
+		#define IVTN_NPK_SCI_ERI IVTN_INT_SCI2_ERI2
+		#define IVTN_NPK_SCI_RXI IVTN_INT_SCI2_RXI2
+		#define IVTN_NPK_SCI_TXI IVTN_INT_SCI2_TXI2
+		#define IVTN_NPK_SCI_TEI IVTN_INT_SCI2_TEI2
+		#define ROMCRC_CACHE_ADDR	0xFFFFC000	//above the stack
 	
 	#else
 		#error invalid target for ssmk
@@ -108,6 +212,18 @@
 #define get_mclk_ts(x) (ATU0.TCNT)
 
 
+/** Erase block boundaries, defined by the pl_flash_* implementation.
+ * Block n spans fblocks[n] to (fblocks[n + 1] - 1); fblocks[fl_nblocks] is the end delimiter.
+ */
+extern const uint32_t fblocks[];
+extern const unsigned fl_nblocks;
+
+/** size of one flash programming unit, in bytes. platf_flash_wb() dest and len must be multiples of this */
+extern const unsigned fl_wgran;
+
+/** 1 if block erases are blank-checked before reporting success */
+extern const bool fl_everify;
+
 /** Ret 1 if ok
  *
  * sets *err to a negative response code if failed
@@ -121,11 +237,21 @@ bool platf_flash_init(uint8_t *err);
  */
 void platf_flash_unprotect(void);
 
-/** Erase block, see definition of blocks in DS.
+/** @return 1 if platf_flash_unprotect() was called, i.e. erase / write calls actually modify the flash */
+bool platf_flash_unprotected(void);
+
+/** Start erasing a block (see definition of blocks in DS) in the background; platf_flash_eb_step() must then be called until done.
+ * No other flash operation is allowed in the meantime.
  *
  * ret 0 if ok
  */
-uint32_t platf_flash_eb(unsigned blockno);
+uint32_t platf_flash_eb_start(unsigned blockno);
+
+/** Do one erase step (pulse + verify, or the whole erase if the hardware can't be interrupted)
+ *
+ * ret PFEB_BUSY if not done yet, 0 if done (or nothing to do), or an erase error code.
+ */
+uint32_t platf_flash_eb_step(void);
 
 /** Write block of data. len must be multiple of SIDFL_WB_DLEN
  *
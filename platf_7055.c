@@ -30,11 +30,13 @@
 #include "stypes.h"
 #include "platf.h"
 #include "wdt.h"
+#include "cmd_parser.h"
 
 /* init SCI to continue comms on K line */
 static void init_sci(void) {
 	NPK_SCI.SCR.BYTE &= 0x2F;	//clear TXIE, RXIE, RE
 	NPK_SCI.SCR.BIT.TE = 1;	//enable TX
+	NPK_SCI_IPR = 0x0A;	//above WDT; RXIE is set in cmd_init(), TIE + TEIE by iso_sendpkt()
 	return;
 }
 
@@ -55,6 +57,32 @@ void INT_ATU11_IMI1A(void) {
 	return;
 }
 
+/** SCI receive interrupts, feed the RX ring buffer in cmd_parser.c */
+void INT_NPK_SCI_RXI(void) ISR_attrib;
+void INT_NPK_SCI_RXI(void) {
+	sci_rxi();
+	return;
+}
+
+void INT_NPK_SCI_ERI(void) ISR_attrib;
+void INT_NPK_SCI_ERI(void) {
+	sci_eri();
+	return;
+}
+
+/** SCI transmit interrupts, send the frame queued by iso_sendpkt() */
+void INT_NPK_SCI_TXI(void) ISR_attrib;
+void INT_NPK_SCI_TXI(void) {
+	sci_txi();
+	return;
+}
+
+void INT_NPK_SCI_TEI(void) ISR_attrib;
+void INT_NPK_SCI_TEI(void) {
+	sci_tei();
+	return;
+}
+
 // ISR handler that saves the previous PC value at the top of RAM, then dies of external WDT.
 void die_trace(void) __attribute__ ((noreturn));
 void die_trace(void) {
@@ -134,6 +162,10 @@ static void build_ivt(u32 *dest) {
 	WRITEVECT(IVTN_POR_SP, stackinit);
 	WRITEVECT(IVTN_MR_SP, stackinit);
 	WRITEVECT(IVTN_INT_ATU11_IMI1A, &INT_ATU11_IMI1A);
+	WRITEVECT(IVTN_NPK_SCI_RXI, &INT_NPK_SCI_RXI);
+	WRITEVECT(IVTN_NPK_SCI_ERI, &INT_NPK_SCI_ERI);
+	WRITEVECT(IVTN_NPK_SCI_TXI, &INT_NPK_SCI_TXI);
+	WRITEVECT(IVTN_NPK_SCI_TEI, &INT_NPK_SCI_TEI);
 
 }
 
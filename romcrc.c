@@ -0,0 +1,109 @@
+/* ROM CRC cache; see romcrc.h */
+
+/* (c) copyright fenugrec 2016
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>	//memset
+
+#include "stypes.h"
+#include "platf.h"
+#include "iso_cmds.h"
+#include "crc.h"
+#include "romcrc.h"
+
+#ifdef ROMCRC_CACHE_ADDR
+
+#define RCC_NCHUNKS	(ROMSIZE / ROMCRC_CHUNKSIZE)
+
+/* 8.5kB for 1MB of ROM. Not zeroed at startup, only valid[] matters */
+struct romcrc_cache {
+	u16 crc[RCC_NCHUNKS];
+	u8 valid[RCC_NCHUNKS / 8];	//bit set : crc[] entry is up to date
+};
+
+#define rcc ((struct romcrc_cache *) ROMCRC_CACHE_ADDR)
+
+/* every chunk below this is valid, so romcrc_idle() has nothing to do once it reaches RCC_NCHUNKS */
+static unsigned rcc_next;
+
+static bool rcc_isvalid(unsigned chunkno) {
+	return rcc->valid[chunkno / 8] & (1 << (chunkno & 7));
+}
+
+static u16 rcc_fill(unsigned chunkno) {
+	u16 crc = crc16((const u8 *) (chunkno * ROMCRC_CHUNKSIZE), ROMCRC_CHUNKSIZE);
+	rcc->crc[chunkno] = crc;
+	rcc->valid[chunkno / 8] |= 1 << (chunkno & 7);
+	return crc;
+}
+
+void romcrc_init(void) {
+	memset(rcc->valid, 0, sizeof(rcc->valid));
+	rcc_next = 0;
+}
+
+/* one chunk is ~3k cycles; incoming bytes pile up in the SCI ring buffer meanwhile */
+void romcrc_idle(void) {
+	while (rcc_next < RCC_NCHUNKS) {
+		unsigned chunkno = rcc_next++;
+		if (!rcc_isvalid(chunkno)) {
+			rcc_fill(chunkno);
+			return;
+		}
+	}
+}
+
+u16 romcrc_get(u32 chunkno) {
+	if (chunkno >= RCC_NCHUNKS) {
+		return crc16((const u8 *) (chunkno * ROMCRC_CHUNKSIZE), ROMCRC_CHUNKSIZE);
+	}
+	if (rcc_isvalid(chunkno)) {
+		return rcc->crc[chunkno];
+	}
+	return rcc_fill(chunkno);
+}
+
+void romcrc_inval(u32 start, u32 len) {
+	u32 chunkno = start / ROMCRC_CHUNKSIZE;
+	u32 end = (start + len + ROMCRC_CHUNKSIZE - 1) / ROMCRC_CHUNKSIZE;
+
+	if (end > RCC_NCHUNKS) end = RCC_NCHUNKS;
+	if (chunkno >= end) return;
+	if (chunkno < rcc_next) rcc_next = chunkno;
+
+	for (; chunkno < end; chunkno++) {
+		rcc->valid[chunkno / 8] &= ~(1 << (chunkno & 7));
+	}
+}
+
+#else	//no cache
+
+void romcrc_init(void) {}
+
+void romcrc_idle(void) {}
+
+u16 romcrc_get(u32 chunkno) {
+	return crc16((const u8 *) (chunkno * ROMCRC_CHUNKSIZE), ROMCRC_CHUNKSIZE);
+}
+
+void romcrc_inval(u32 start, u32 len) {
+	(void) start;
+	(void) len;
+}
+
+#endif
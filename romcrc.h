@@ -0,0 +1,22 @@
+#ifndef _ROMCRC_H
+#define _ROMCRC_H
+
+#include "stypes.h"
+
+/* ROM CRC cache : crc16 of every ROMCRC_CHUNKSIZE chunk of ROM, filled while cmd_loop() is idle.
+ * Lives at ROMCRC_CACHE_ADDR (see platf.h); on targets without it, every query is computed.
+ */
+
+/** invalidate the whole cache. Must be called once before anything else */
+void romcrc_init(void);
+
+/** compute one missing entry, if any. Called when there is nothing else to do */
+void romcrc_idle(void);
+
+/** crc16 of ROM chunk # chunkno, from the cache if possible */
+u16 romcrc_get(u32 chunkno);
+
+/** invalidate every chunk overlapping [start, start + len[. Called before modifying flash */
+void romcrc_inval(u32 start, u32 len);
+
+#endif
@@ -0,0 +1,159 @@
+/* lz.c round-trip tests, built for the host (see CMakeLists.txt).
+ *
+ * Every input is encoded the same way SID_DUMP_ROMLZ does it (blocks of at most
+ * SID_DUMP_LZ_DLEN bytes of output), each block is decoded by itself, and the result is
+ * compared with the input.
+ */
+
+/* (c) copyright fenugrec 2016
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stypes.h"
+#include "iso_cmds.h"
+#include "lz.h"
+
+#define TESTBUF_SIZE	(8 * 1024)
+
+static u8 src[TESTBUF_SIZE];
+static u8 dec[TESTBUF_SIZE];
+
+static int failures = 0;
+
+/** encode + decode srclen bytes of src in blocks of at most blkmax bytes.
+ * @return total compressed size, or -1 if failed
+ */
+static int roundtrip(const char *name, unsigned srclen, unsigned blkmax) {
+	u8 blk[256];
+	unsigned pos = 0;
+	unsigned total = 0;
+
+	while (pos < srclen) {
+		unsigned consumed;
+		unsigned clen;
+		int dlen;
+
+		clen = lz_encode(&src[pos], srclen - pos, blk, blkmax, &consumed);
+		if ((consumed == 0) || (clen > blkmax)) {
+			printf("FAIL %s : encode @ %u : clen %u, consumed %u\n", name, pos, clen, consumed);
+			goto bad;
+		}
+		dlen = lz_decode(blk, clen, &dec[pos], consumed);
+		if (dlen != (int) consumed) {
+			printf("FAIL %s : decode @ %u : %d bytes, expected %u\n", name, pos, dlen, consumed);
+			goto bad;
+		}
+		pos += consumed;
+		total += clen;
+	}
+
+	if (memcmp(src, dec, srclen)) {
+		printf("FAIL %s : data mismatch\n", name);
+		goto bad;
+	}
+	printf("ok   %s : %u -> %u bytes\n", name, srclen, total);
+	return total;
+
+bad:
+	failures++;
+	return -1;
+}
+
+/** malformed streams must be rejected, not overflow dst */
+static void test_malformed(void) {
+	static const u8 match_before_start[] = {0x80, 0x00};	//match with nothing decoded yet
+	static const u8 truncated_lit[] = {0x05, 'a', 'b'};	//6 literals announced, 2 present
+	static const u8 truncated_match[] = {0x00, 'a', 0x80};	//missing <OFS>
+	static const u8 long_run[] = {0x00, 'a', 0xFF, 0x00};	//1 + 130 bytes
+
+	if (lz_decode(match_before_start, sizeof(match_before_start), dec, sizeof(dec)) != -1) {
+		printf("FAIL malformed : match before start accepted\n");
+		failures++;
+	}
+	if (lz_decode(truncated_lit, sizeof(truncated_lit), dec, sizeof(dec)) != -1) {
+		printf("FAIL malformed : truncated literal run accepted\n");
+		failures++;
+	}
+	if (lz_decode(truncated_match, sizeof(truncated_match), dec, sizeof(dec)) != -1) {
+		printf("FAIL malformed : truncated match accepted\n");
+		failures++;
+	}
+	if (lz_decode(long_run, sizeof(long_run), dec, 100) != -1) {
+		printf("FAIL malformed : dstmax overflow accepted\n");
+		failures++;
+	}
+	if (lz_decode(long_run, sizeof(long_run), dec, sizeof(dec)) != (1 + LZ_MAXMATCH)) {
+		printf("FAIL malformed : valid run rejected\n");
+		failures++;
+	}
+	printf("ok   malformed streams\n");
+}
+
+int main(void) {
+	unsigned i;
+	int clen;
+
+	/* RLE : blank flash and a few long runs */
+	memset(src, 0xFF, sizeof(src));
+	clen = roundtrip("blank", sizeof(src), SID_DUMP_LZ_DLEN);
+	if ((clen > 0) && (clen > (int) (sizeof(src) / 16))) {
+		printf("FAIL blank : poor compression\n");
+		failures++;
+	}
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (i / 300) & 0xFF;
+	}
+	roundtrip("runs", sizeof(src), SID_DUMP_LZ_DLEN);
+
+	/* back-references : repeated records, at various distances */
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (i % 37) * 7;
+	}
+	roundtrip("period 37", sizeof(src), SID_DUMP_LZ_DLEN);
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (i % 100) ^ (i / 1024);
+	}
+	roundtrip("period 100", sizeof(src), SID_DUMP_LZ_DLEN);
+
+	/* incompressible : must still round-trip, with bounded expansion */
+	srand(1);
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = rand() & 0xFF;
+	}
+	clen = roundtrip("random", sizeof(src), SID_DUMP_LZ_DLEN);
+	if ((clen > 0) && (clen > (int) (sizeof(src) + sizeof(src) / 64 + 64))) {
+		printf("FAIL random : expansion too large\n");
+		failures++;
+	}
+
+	/* tiny output blocks and odd lengths */
+	roundtrip("random, 2B blocks", 257, 2);
+	memset(src, 0x55, 5);
+	roundtrip("5 bytes", 5, SID_DUMP_LZ_DLEN);
+	roundtrip("1 byte", 1, SID_DUMP_LZ_DLEN);
+
+	test_malformed();
+
+	if (failures) {
+		printf("%d failure(s)\n", failures);
+		return 1;
+	}
+	return 0;
+}